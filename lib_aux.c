@@ -15,6 +15,7 @@
 
 #include "lua.h"
 #include "lauxlib.h"
+#include "luajit.h"
 
 #include "lj_obj.h"
 #include "lj_err.h"
@@ -336,14 +337,28 @@ LUALIB_API lua_State *luaL_newstate(void)
   return L;
 }
 
+LUA_API lua_State *luaJIT_newstate(size_t segsize, int mode, int node)
+{
+  UNUSED(segsize); UNUSED(mode); UNUSED(node);
+  return luaL_newstate();
+}
+
 #else
 
 #include "lj_alloc.h"
 
+LJ_STATIC_ASSERT(LUAJIT_ALLOC_HUGEPAGE == LJ_ALLOCMODE_HUGEPAGE &&
+		 LUAJIT_ALLOC_HUGETLB == LJ_ALLOCMODE_HUGETLB);
+
 LUALIB_API lua_State *luaL_newstate(void)
+{
+  return luaJIT_newstate(0, 0, -1);
+}
+
+LUA_API lua_State *luaJIT_newstate(size_t segsize, int mode, int node)
 {
   lua_State *L;
-  void *ud = lj_alloc_create();
+  void *ud = lj_alloc_createx(segsize, mode, node);
   if (ud == NULL) return NULL;
 #if LJ_64 && !LJ_GC64
   L = lj_state_newstate(lj_alloc_f, ud);
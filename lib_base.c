@@ -14,6 +14,7 @@
 #include "lua.h"
 #include "lauxlib.h"
 #include "lualib.h"
+#include "luajit.h"
 
 #include "lj_obj.h"
 #include "lj_gc.h"
@@ -440,13 +441,29 @@ static int pushmode (lua_State *L, int oldmode) {
 
 LJLIB_CF(collectgarbage)
 {
-  int opt = lj_lib_checkopt(L, 1, LUA_GCCOLLECT,  /* ORDER LUA_GC* */
-    "\4stop\7restart\7collect\5count\1\377\4step\10setpause\12setstepmul\1\377\11isrunning\14generational\13incremental");
-  int res;
+  GCstr *s = lj_lib_optstr(L, 1);
+  int opt, res;
+  /* Options without a lua_gc() counterpart push a table. */
+  if (s && strcmp(strdata(s), "stats") == 0) {
+    luaJIT_gcstats(L, lua_toboolean(L, 2));
+    return 1;
+  } else if (s && strcmp(strdata(s), "allocstats") == 0) {
+    luaJIT_allocstats(L);
+    return 1;
+  }
+  opt = lj_lib_checkopt(L, 1, LUA_GCCOLLECT,  /* ORDER LUA_GC* */
+    "\4stop\7restart\7collect\5count\1\377\4step\10setpause\12setstepmul\1\377\11isrunning\14generational\13incremental\15setgenstepmul\14setgenbadmul\17setgenstablemul\11setbgfree\12setmarkers\1\377\12setnursery\1\377\4trim\13setautotrim");
   switch (opt) {
     case LUA_GCRESTART:
     case LUA_GCSETPAUSE:
-    case LUA_GCSETSTEPMUL: {
+    case LUA_GCSETSTEPMUL:
+    case LUA_GCSETGENSTEPMUL:
+    case LUA_GCSETGENBADMUL:
+    case LUA_GCSETGENSTABLEMUL:
+    case LUA_GCSETBGFREE:
+    case LUA_GCSETMARKERS:
+    case LUA_GCSETNURSERY:
+    case LUA_GCSETAUTOTRIM: {
       int32_t data = luaL_optinteger(L, 2, 0);
       res = lua_gc(L, opt, data);
       lua_pushinteger(L, res);
@@ -478,6 +495,9 @@ LJLIB_CF(collectgarbage)
       int stepsize = (int)luaL_optinteger(L, 4, 0);
       return pushmode(L, lua_gc(L, opt, pause, stepmul, stepsize));
     }
+    case LUA_GCTRIM:  /* Return the exact number of bytes released. */
+      lua_pushnumber(L, (lua_Number)lj_gc_trim(G(L)));
+      return 1;
     default: {
       res = lua_gc(L, opt);
       lua_pushinteger(L, res);
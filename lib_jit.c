@@ -425,6 +425,27 @@ LJLIB_CF(jit_util_ircalladdr)
   return 0;
 }
 
+/* -- Reflection API for tables ------------------------------------------- */
+
+/* local info = jit.util.tabinfo(tab) */
+LJLIB_CF(jit_util_tabinfo)
+{
+  GCtab *tab = lj_lib_checktab(L, 1);
+  uint32_t maxlen;
+  uint64_t sumlen;
+  uint32_t nkeys = lj_tab_chainstats(tab, &maxlen, &sumlen);
+  GCtab *t;
+  lua_createtable(L, 0, 8);  /* Increment hash size if fields are added. */
+  t = tabV(L->top-1);
+  setintfield(L, t, "asize", (int32_t)tab->asize);
+  setintfield(L, t, "hsize", tab->hmask > 0 ? (int32_t)tab->hmask+1 : 0);
+  setintfield(L, t, "hkeys", (int32_t)nkeys);
+  setintfield(L, t, "maxchain", (int32_t)maxlen);
+  setnumV(lj_tab_setstr(L, t, lj_str_newlit(L, "meanchain")),
+	  nkeys ? (lua_Number)sumlen / (lua_Number)nkeys : 0);
+  return 1;
+}
+
 #endif
 
 #include "lj_libdef.h"
@@ -566,14 +587,20 @@ static void jit_profile_callback(lua_State *L2, lua_State *L, int samples,
   }
 }
 
-/* profile.start(mode, cb) */
+/* profile.start(mode [, cb]) -- Without cb samples are aggregated natively. */
 LJLIB_CF(jit_profile_start)
 {
   GCtab *registry = tabV(registry(L));
   GCstr *mode = lj_lib_optstr(L, 1);
-  GCfunc *func = lj_lib_checkfunc(L, 2);
-  lua_State *L2 = lua_newthread(L);  /* Thread that runs profiler callback. */
+  GCfunc *func;
+  lua_State *L2;
   TValue key;
+  if (L->base+1 >= L->top || tvisnil(L->base+1)) {
+    luaJIT_profile_start(L, mode ? strdata(mode) : "", NULL, NULL);
+    return 0;
+  }
+  func = lj_lib_checkfunc(L, 2);
+  L2 = lua_newthread(L);  /* Thread that runs profiler callback. */
   /* Anchor thread and function in registry. */
   setlightudV(&key, (void *)&KEY_PROFILE_THREAD);
   setthreadV(L, lj_tab_set(L, registry, &key), L2);
@@ -620,6 +647,35 @@ LJLIB_CF(jit_profile_dumpstack)
   return 1;
 }
 
+/* folded = profile.folded() */
+LJLIB_CF(jit_profile_folded)
+{
+  size_t len;
+  const char *p = luaJIT_profile_dumpfolded(L, &len);
+  lua_pushlstring(L, p, len);
+  return 1;
+}
+
+/* profile.alloc(rate [, trackold]) -- A rate of 0 stops sampling. */
+LJLIB_CF(jit_profile_alloc)
+{
+  int32_t rate = lj_lib_checkint(L, 1);
+  int trackold = L->base+1 < L->top && tvistruecond(L->base+1);
+  luaJIT_profile_alloc(L, rate > 0 ? (size_t)rate : 0, trackold);
+  return 0;
+}
+
+/* folded = profile.allocfolded([what]) */
+LJLIB_CF(jit_profile_allocfolded)
+{
+  GCstr *what = lj_lib_optstr(L, 1);
+  size_t len;
+  const char *p = luaJIT_profile_dumpalloc(L, what && what->len ?
+					   (uint8_t)strdata(what)[0] : 'b', &len);
+  lua_pushlstring(L, p, len);
+  return 1;
+}
+
 #include "lj_libdef.h"
 
 static int luaopen_jit_profile(lua_State *L)
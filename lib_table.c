@@ -17,14 +17,26 @@
 #include "lj_gc.h"
 #include "lj_err.h"
 #include "lj_buf.h"
+#include "lj_str.h"
 #include "lj_tab.h"
+#include "lj_state.h"
 #include "lj_ff.h"
 #include "lj_lib.h"
+#include "lj_vm.h"
 
 /* ------------------------------------------------------------------------ */
 
 #define LJLIB_MODULE_table
 
+/* Check argument for a table that may be modified. */
+static GCtab *tab_checkw(lua_State *L, int narg)
+{
+  GCtab *t = lj_lib_checktab(L, narg);
+  if (LJ_UNLIKELY(tabisfrozen(t)))
+    lj_err_msg(L, LJ_ERR_TABRO);
+  return t;
+}
+
 LJLIB_LUA(table_foreachi) /*
   function(t, f)
     CHECK_tab(t)
@@ -78,7 +90,7 @@ LJLIB_CF(table_maxn)
 
 LJLIB_CF(table_insert)		LJLIB_REC(.)
 {
-  GCtab *t = lj_lib_checktab(L, 1);
+  GCtab *t = tab_checkw(L, 1);
   int32_t n, i = (int32_t)lj_tab_len(t) + 1;
   int nargs = (int)((char *)L->top - (char *)L->base);
   if (nargs != 2*sizeof(TValue)) {
@@ -96,6 +108,9 @@ LJLIB_CF(table_insert)		LJLIB_REC(.)
       }
     }
     i = n;
+    /* Elements may have moved to a clean card, so mark the whole table. */
+    if (sizetabcards(t->asize))
+      lj_gc_anybarriert(L, t);
   }
   {
     TValue *dst = lj_tab_setint(L, t, i);
@@ -171,102 +186,213 @@ LJLIB_CF(table_concat)		LJLIB_REC(.)
 
 /* ------------------------------------------------------------------------ */
 
-static void set2(lua_State *L, int i, int j)
-{
-  lua_rawseti(L, 1, i);
-  lua_rawseti(L, 1, j);
-}
+/* Kinds of sort comparisons. */
+enum {
+  SORT_NUM,		/* All numbers, no comparator. */
+  SORT_STR,		/* All strings, no comparator. */
+  SORT_LT,		/* Mixed types, no comparator: the < operator. */
+  SORT_FUNC		/* Comparator function in slot 2. */
+};
 
-static int sort_comp(lua_State *L, int a, int b)
+/* a < b? Only SORT_LT and SORT_FUNC may call back into Lua. */
+static LJ_AINLINE int sort_lt(lua_State *L, int kind, cTValue *a, cTValue *b)
 {
-  if (!lua_isnil(L, 2)) {  /* function? */
+  if (kind == SORT_NUM) {
+    return numberVnum(a) < numberVnum(b);
+  } else if (kind == SORT_STR) {
+    return lj_str_cmp(strV(a), strV(b)) < 0;
+  } else {
+    TValue *o = L->top;
+    ptrdiff_t top = savestack(L, o);  /* The callback may realloc the stack. */
     int res;
-    lua_pushvalue(L, 2);
-    lua_pushvalue(L, a-1);  /* -1 to compensate function */
-    lua_pushvalue(L, b-2);  /* -2 to compensate function and `a' */
-    lua_call(L, 2, 1);
-    res = lua_toboolean(L, -1);
-    lua_pop(L, 1);
+    if (kind == SORT_FUNC) {
+      copyTV(L, o, L->base+1);
+      if (LJ_FR2) setnilV(o+1);
+      copyTV(L, o+1+LJ_FR2, a);
+      copyTV(L, o+2+LJ_FR2, b);
+      L->top = o+3+LJ_FR2;
+      lj_vm_call(L, o+1+LJ_FR2, 1+1);
+      res = tvistruecond(L->top-1);
+    } else if (tvisnumber(a) && tvisnumber(b)) {
+      return numberVnum(a) < numberVnum(b);
+    } else if (tvisstr(a) && tvisstr(b)) {
+      return lj_str_cmp(strV(a), strV(b)) < 0;
+    } else {
+      copyTV(L, o, a);
+      copyTV(L, o+1, b);
+      L->top = o+2;
+      res = lua_lessthan(L, -2, -1);
+    }
+    L->top = restorestack(L, top);
     return res;
-  } else {  /* a < b? */
-    return lua_lessthan(L, a, b);
   }
 }
 
-static void auxsort(lua_State *L, int l, int u)
+/*
+** Stack slots of table.sort() that anchor values held across callbacks:
+** the value being inserted and the pivot. Relative to L->base, since the
+** callbacks may reallocate the stack.
+*/
+#define sort_x(L)	((L)->base+3)
+#define sort_p(L)	((L)->base+4)
+
+#define sort_swap(a, i, j) \
+  { TValue tmp_ = (a)[(i)]; (a)[(i)] = (a)[(j)]; (a)[(j)] = tmp_; }
+
+/* Insertion sort of a[lo..hi]. */
+static void sort_insertion(lua_State *L, int kind, TValue *a, MSize lo,
+			   MSize hi)
 {
-  while (l < u) {  /* for tail recursion */
-    int i, j;
-    /* sort elements a[l], a[(l+u)/2] and a[u] */
-    lua_rawgeti(L, 1, l);
-    lua_rawgeti(L, 1, u);
-    if (sort_comp(L, -1, -2))  /* a[u] < a[l]? */
-      set2(L, l, u);  /* swap a[l] - a[u] */
-    else
-      lua_pop(L, 2);
-    if (u-l == 1) break;  /* only 2 elements */
-    i = (l+u)/2;
-    lua_rawgeti(L, 1, i);
-    lua_rawgeti(L, 1, l);
-    if (sort_comp(L, -2, -1)) {  /* a[i]<a[l]? */
-      set2(L, i, l);
-    } else {
-      lua_pop(L, 1);  /* remove a[l] */
-      lua_rawgeti(L, 1, u);
-      if (sort_comp(L, -1, -2))  /* a[u]<a[i]? */
-	set2(L, i, u);
-      else
-	lua_pop(L, 2);
+  MSize i, j;
+  for (i = lo+1; i <= hi; i++) {
+    copyTV(L, sort_x(L), &a[i]);
+    for (j = i; j > lo && sort_lt(L, kind, sort_x(L), &a[j-1]); j--)
+      a[j] = a[j-1];
+    copyTV(L, &a[j], sort_x(L));
+  }
+}
+
+/* Heapsort of a[lo..hi]. Bounds the worst case of the quicksort. */
+static void sort_heap(lua_State *L, int kind, TValue *a, MSize lo, MSize hi)
+{
+  MSize n = hi-lo+1, i, k, c;
+  TValue *h = a+lo;
+  for (i = n/2; i-- > 0; ) {  /* Build the heap. */
+    for (k = i; (c = 2*k+1) < n; k = c) {
+      if (c+1 < n && sort_lt(L, kind, &h[c], &h[c+1])) c++;
+      if (!sort_lt(L, kind, &h[k], &h[c])) break;
+      sort_swap(h, k, c);
     }
-    if (u-l == 2) break;  /* only 3 elements */
-    lua_rawgeti(L, 1, i);  /* Pivot */
-    lua_pushvalue(L, -1);
-    lua_rawgeti(L, 1, u-1);
-    set2(L, i, u-1);
-    /* a[l] <= P == a[u-1] <= a[u], only need to sort from l+1 to u-2 */
-    i = l; j = u-1;
-    for (;;) {  /* invariant: a[l..i] <= P <= a[j..u] */
-      /* repeat ++i until a[i] >= P */
-      while (lua_rawgeti(L, 1, ++i), sort_comp(L, -1, -2)) {
-	if (i>=u) lj_err_caller(L, LJ_ERR_TABSORT);
-	lua_pop(L, 1);  /* remove a[i] */
-      }
-      /* repeat --j until a[j] <= P */
-      while (lua_rawgeti(L, 1, --j), sort_comp(L, -3, -1)) {
-	if (j<=l) lj_err_caller(L, LJ_ERR_TABSORT);
-	lua_pop(L, 1);  /* remove a[j] */
-      }
-      if (j<i) {
-	lua_pop(L, 3);  /* pop pivot, a[i], a[j] */
-	break;
-      }
-      set2(L, i, j);
+  }
+  for (i = n-1; i > 0; i--) {  /* Move the max. to the end. */
+    sort_swap(h, 0, i);
+    for (k = 0; (c = 2*k+1) < i; k = c) {
+      if (c+1 < i && sort_lt(L, kind, &h[c], &h[c+1])) c++;
+      if (!sort_lt(L, kind, &h[k], &h[c])) break;
+      sort_swap(h, k, c);
     }
-    lua_rawgeti(L, 1, u-1);
-    lua_rawgeti(L, 1, i);
-    set2(L, u-1, i);  /* swap pivot (a[u-1]) with a[i] */
-    /* a[l..i-1] <= a[i] == P <= a[i+1..u] */
-    /* adjust so that smaller half is in [j..i] and larger one in [l..u] */
-    if (i-l < u-i) {
-      j=l; i=i-1; l=i+2;
+  }
+}
+
+/* Introsort of a[lo..hi]: quicksort with a median-of-3 pivot, heapsort
+** when the partitions degenerate and insertion sort for short ranges.
+** The scans are bounds-checked, so an invalid order function raises an
+** error instead of running off the array.
+*/
+static void sort_intro(lua_State *L, int kind, TValue *a, MSize lo, MSize hi,
+		       int depth)
+{
+  while (hi - lo >= 16) {
+    MSize i, j, m = lo + (hi-lo)/2;
+    if (depth-- == 0) {
+      sort_heap(L, kind, a, lo, hi);
+      return;
+    }
+    if (sort_lt(L, kind, &a[m], &a[lo])) sort_swap(a, m, lo);
+    if (sort_lt(L, kind, &a[hi], &a[m])) {
+      sort_swap(a, hi, m);
+      if (sort_lt(L, kind, &a[m], &a[lo])) sort_swap(a, m, lo);
+    }
+    copyTV(L, sort_p(L), &a[m]);  /* a[lo] <= p <= a[hi] */
+    i = lo; j = hi;
+    for (;;) {  /* Hoare partition. */
+      while (sort_lt(L, kind, &a[i], sort_p(L)))
+	if (++i > hi) lj_err_caller(L, LJ_ERR_TABSORT);
+      while (sort_lt(L, kind, sort_p(L), &a[j]))
+	if (j-- == lo) lj_err_caller(L, LJ_ERR_TABSORT);
+      if (i >= j) break;
+      sort_swap(a, i, j);
+      i++; j--;
+    }
+    if (j >= hi) j = hi-1;  /* Only for an invalid order function. */
+    /* a[lo..j] <= p <= a[j+1..hi]. Recurse into the smaller part. */
+    if (j - lo < hi - j) {
+      sort_intro(L, kind, a, lo, j, depth);
+      lo = j+1;
     } else {
-      j=i+1; i=u; u=j-2;
+      sort_intro(L, kind, a, j+1, hi, depth);
+      hi = j;
     }
-    auxsort(L, j, i);  /* call recursively the smaller one */
-  }  /* repeat the routine for the larger one */
+  }
+  if (lo < hi)
+    sort_insertion(L, kind, a, lo, hi);
+}
+
+/* Sort a[0..n-1]. */
+static void sort_array(lua_State *L, int kind, TValue *a, MSize n)
+{
+  int depth = 0;
+  MSize k;
+  for (k = n; k > 1; k >>= 1) depth += 2;  /* 2*log2(n) */
+  if (n > 1)
+    sort_intro(L, kind, a, 0, n-1, depth);
 }
 
 LJLIB_CF(table_sort)
 {
-  GCtab *t = lj_lib_checktab(L, 1);
-  int32_t n = (int32_t)lj_tab_len(t);
+  GCtab *t = tab_checkw(L, 1);
+  MSize n = (MSize)lj_tab_len(t), i;
+  int kind;
+  GCtab *tmp;
+  TValue *a;
   lua_settop(L, 2);
-  if (!tvisnil(L->base+1))
+  lj_state_checkstack(L, 6+LJ_FR2);
+  lua_settop(L, 5);  /* Slots for the private copy, sort_x() and sort_p(). */
+  if (!tvisnil(L->base+1)) {
     lj_lib_checkfunc(L, 2);
-  auxsort(L, 1, n);
+    kind = SORT_FUNC;
+  } else if (n < t->asize) {  /* Try to sort the array part in place. */
+    a = tvref(t->array) + 1;
+    kind = n && tvisstr(&a[0]) ? SORT_STR : SORT_NUM;
+    for (i = 0; i < n; i++) {
+      cTValue *o = &a[i];
+      if (kind == SORT_STR ? !tvisstr(o) :
+	  !tvisnumber(o) || (tvisnum(o) && tvisnan(o))) {  /* NaN: no order. */
+	kind = SORT_LT;
+	break;
+      }
+    }
+    if (kind != SORT_LT) {  /* Never calls back, so nothing can move. */
+      sort_array(L, kind, a, n);
+      if (sizetabcards(t->asize))  /* Values moved between cards. */
+	lj_gc_anybarriert(L, t);
+      return 0;
+    }
+  } else {
+    kind = SORT_LT;
+  }
+  /*
+  ** Callbacks may modify the table, so sort a private copy. It's anchored
+  ** on the stack and its array part can't be resized under our feet.
+  */
+  tmp = lj_tab_new(L, n, 0);
+  settabV(L, L->base+2, tmp);
+  a = tvref(tmp->array);
+  for (i = 0; i < n; i++) {
+    cTValue *o = lj_tab_getint(t, (int32_t)(i+1));
+    if (o) copyTV(L, &a[i], o); else setnilV(&a[i]);
+  }
+  sort_array(L, kind, a, n);
+  for (i = 0; i < n; i++)
+    copyTV(L, lj_tab_setint(L, t, (int32_t)(i+1)), &a[i]);
+  lj_gc_anybarriert(L, t);
   return 0;
 }
 
+/*
+** Freezing repacks the table for single-node lookups and rejects any later
+** store: adding keys, storing through the library and the C API, and
+** assignments to existing keys. The interpreters send these through the
+** vmeta_tset* fallbacks. Compiled code guards on the frozen bit once any
+** table has been frozen.
+*/
+LJLIB_CF(table_freeze)
+{
+  lj_tab_freeze(L, lj_lib_checktab(L, 1));
+  L->top = L->base+1;
+  return 1;
+}
+
 #if LJ_52
 LJLIB_PUSH("n")
 LJLIB_CF(table_pack)
@@ -295,7 +421,7 @@ LJLIB_NOREG LJLIB_CF(table_new)		LJLIB_REC(.)
 
 LJLIB_NOREG LJLIB_CF(table_clear)	LJLIB_REC(.)
 {
-  lj_tab_clear(lj_lib_checktab(L, 1));
+  lj_tab_clear(tab_checkw(L, 1));
   return 0;
 }
 
@@ -205,6 +205,14 @@ static int CALL_MUNMAP(void *ptr, size_t size)
   return 0;
 }
 
+/* Tell the OS that the contents of these pages are no longer needed. */
+static void CALL_DISCARD(void *ptr, size_t size)
+{
+  DWORD olderr = GetLastError();
+  VirtualAlloc(ptr, size, MEM_RESET, PAGE_READWRITE);
+  SetLastError(olderr);
+}
+
 #elif LJ_ALLOC_MMAP
 
 #define MMAP_PROT		(PROT_READ|PROT_WRITE)
@@ -365,6 +373,16 @@ static int CALL_MUNMAP(void *ptr, size_t size)
   return ret;
 }
 
+#ifdef MADV_DONTNEED
+/* Drop the pages right away, so the RSS shrinks, too. Unlike MADV_FREE. */
+static void CALL_DISCARD(void *ptr, size_t size)
+{
+  int olderr = errno;
+  madvise(ptr, size, MADV_DONTNEED);
+  errno = olderr;
+}
+#endif
+
 #if LJ_ALLOC_MREMAP
 /* Need to define _GNU_SOURCE to get the mremap prototype. */
 static void *CALL_MREMAP_(void *ptr, size_t osz, size_t nsz, int flags)
@@ -400,6 +418,99 @@ static void *CALL_MREMAP_(void *ptr, size_t osz, size_t nsz, int flags)
 #define CALL_MREMAP(addr, osz, nsz, mv) ((void)osz, MFAIL)
 #endif
 
+#if !LJ_ALLOC_VIRTUALALLOC && !defined(MADV_DONTNEED)
+#define CALL_DISCARD(ptr, size)	((void)(ptr), (void)(size))
+#endif
+
+/* ------------------- Huge pages and NUMA placement ---------------------- */
+
+#define HUGE_PAGESIZE		((size_t)2U * (size_t)1024U * (size_t)1024U)
+#define LJ_ALLOC_MAXNODE	1024
+
+#define is_hugemode(mode)\
+  (((mode) & (LJ_ALLOCMODE_HUGEPAGE|LJ_ALLOCMODE_HUGETLB)) != 0)
+
+/* huge-page-align a size */
+#define huge_align(S)\
+  (((S) + (HUGE_PAGESIZE - SIZE_T_ONE)) & ~(HUGE_PAGESIZE - SIZE_T_ONE))
+
+#if LJ_ALLOC_MMAP && LJ_TARGET_LINUX
+
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#define LJ_ALLOC_HUGE		1
+
+/* Prefer the given NUMA node for a fresh mapping. Avoids a libnuma dep. */
+static void mmap_numa(void *ptr, size_t size, int node)
+{
+#ifdef SYS_mbind
+  if (node >= 0 && node < LJ_ALLOC_MAXNODE) {
+    unsigned long mask[LJ_ALLOC_MAXNODE/(8*sizeof(unsigned long))];
+    int olderr = errno;
+    memset(mask, 0, sizeof(mask));
+    mask[node/(8*sizeof(unsigned long))] =
+      1UL << (node%(8*sizeof(unsigned long)));
+    /* 1 = MPOL_PREFERRED. Ignore result, the policy is only a hint. */
+    syscall(SYS_mbind, ptr, size, 1, mask, sizeof(mask)*8+1, 0);
+    errno = olderr;
+  }
+#else
+  UNUSED(ptr); UNUSED(size); UNUSED(node);
+#endif
+}
+
+/* Map a huge-page-aligned block. The size must be huge-page-aligned, too. */
+static void *mmap_huge(size_t size, int mode)
+{
+  char *ptr;
+#if defined(MAP_HUGETLB) && (LJ_GC64 || !LJ_64)
+  if ((mode & LJ_ALLOCMODE_HUGETLB)) {  /* Needs a reserved hugetlb pool. */
+    int olderr = errno;
+    ptr = (char *)mmap(NULL, size, MMAP_PROT, MMAP_FLAGS|MAP_HUGETLB, -1, 0);
+    errno = olderr;
+    if (ptr != CMFAIL)
+      return ptr;
+  }
+#else
+  UNUSED(mode);
+#endif
+  /* Otherwise over-allocate and trim to get aligned transparent huge pages. */
+  ptr = (char *)(CALL_MMAP(size + HUGE_PAGESIZE));
+  if (ptr != CMFAIL) {
+    size_t lead = (size_t)(-(intptr_t)ptr) & (HUGE_PAGESIZE - SIZE_T_ONE);
+    if (lead != 0)
+      CALL_MUNMAP(ptr, lead);
+    CALL_MUNMAP(ptr + lead + size, HUGE_PAGESIZE - lead);
+    ptr += lead;
+#ifdef MADV_HUGEPAGE
+    {
+      int olderr = errno;
+      madvise(ptr, size, MADV_HUGEPAGE);  /* Ignore result. */
+      errno = olderr;
+    }
+#endif
+  }
+  return ptr;
+}
+
+#endif
+
+/* Map memory for an mspace with the given allocation mode and NUMA node. */
+static void *mspace_mmap(size_t size, int mode, int node, int direct)
+{
+#if LJ_ALLOC_HUGE
+  void *ptr = is_hugemode(mode) ? mmap_huge(size, mode) :
+	      direct ? DIRECT_MMAP(size) : CALL_MMAP(size);
+  if (ptr != MFAIL)
+    mmap_numa(ptr, size, node);
+  return ptr;
+#else
+  UNUSED(mode); UNUSED(node);
+  return direct ? DIRECT_MMAP(size) : CALL_MMAP(size);
+#endif
+}
+
 /* -----------------------  Chunk representations ------------------------ */
 
 struct malloc_chunk {
@@ -533,6 +644,7 @@ typedef struct malloc_segment *msegmentptr;
 /* Bin types, widths and sizes */
 #define NSMALLBINS		(32U)
 #define NTREEBINS		(32U)
+LJ_STATIC_ASSERT(NSMALLBINS == LJ_ALLOC_NBINS && NTREEBINS == LJ_ALLOC_NBINS);
 #define SMALLBIN_SHIFT		(3U)
 #define SMALLBIN_WIDTH		(SIZE_T_ONE << SMALLBIN_SHIFT)
 #define TREEBIN_SHIFT		(8U)
@@ -540,6 +652,36 @@ typedef struct malloc_segment *msegmentptr;
 #define MAX_SMALL_SIZE		(MIN_LARGE_SIZE - SIZE_T_ONE)
 #define MAX_SMALL_REQUEST  (MAX_SMALL_SIZE - CHUNK_ALIGN_MASK - CHUNK_OVERHEAD)
 
+/* ------------------------------- Slabs ---------------------------------- */
+
+/*
+** Small requests are served from slabs: SLAB_SIZE aligned blocks of
+** objects of a single size class, without per-object headers. A block is
+** in a slab iff its size is at most SLAB_MAXSIZE, so lj_alloc_f can tell
+** them apart by osize. Each slab has its own free list. The slabs with
+** free objects are kept in a list per size class.
+*/
+#define SLAB_SHIFT		14
+#define SLAB_SIZE		((size_t)1 << SLAB_SHIFT)
+#define SLAB_CLASSSHIFT		3
+#define SLAB_MAXSIZE		((size_t)256U)
+#define SLAB_NCLASS		(SLAB_MAXSIZE >> SLAB_CLASSSHIFT)
+
+#define slab_class(s)		(((s) - 1) >> SLAB_CLASSSHIFT)
+#define slab_class2size(c)	(((size_t)(c) + 1) << SLAB_CLASSSHIFT)
+#define slab_of(p)		((slab *)((size_t)(p) & ~(SLAB_SIZE-1)))
+#define slab_first(s)		((char *)(s) + ((sizeof(slab) + 15) & ~(size_t)15))
+#define slab_isfull(s, sz) \
+  ((s)->free == NULL && (s)->bump + (sz) > (char *)(s) + SLAB_SIZE)
+
+typedef struct slab {
+  struct slab *next;		/* Next slab with free objects. */
+  struct slab *prev;		/* Previous slab with free objects. */
+  void *free;			/* List of free objects. */
+  char *bump;			/* Next object never handed out. */
+  size_t nused;			/* Number of objects in use. */
+} slab;
+
 struct malloc_state {
   binmap_t   smallmap;
   binmap_t   treemap;
@@ -552,6 +694,15 @@ struct malloc_state {
   mchunkptr  smallbins[(NSMALLBINS+1)*2];
   tbinptr    treebins[NTREEBINS];
   msegment   seg;
+  slab      *slabs[SLAB_NCLASS];  /* Slabs with free objects per class. */
+  size_t     granularity;  /* Segment granularity, a power of 2. */
+  int        mode;         /* Allocation mode, see LJ_ALLOCMODE_*. */
+  int        node;         /* Preferred NUMA node or -1. */
+  size_t     directsize;   /* Bytes in directly mapped chunks. */
+  size_t     ntrim;        /* Number of times the top segment was shrunk. */
+  size_t     trimmed;      /* Bytes returned by shrinking the top segment. */
+  size_t     nrelease;     /* Number of unmapped unused segments. */
+  size_t     released;     /* Bytes returned by unmapping unused segments. */
 };
 
 typedef struct malloc_state *mstate;
@@ -569,6 +720,10 @@ typedef struct malloc_state *mstate;
   (((S) + (DEFAULT_GRANULARITY - SIZE_T_ONE))\
    & ~(DEFAULT_GRANULARITY - SIZE_T_ONE))
 
+/* align a size to the segment granularity of an mspace */
+#define mspace_align(M, S)\
+  (((S) + ((M)->granularity - SIZE_T_ONE)) & ~((M)->granularity - SIZE_T_ONE))
+
 #if LJ_TARGET_WINDOWS
 #define mmap_align(S)	granularity_align(S)
 #else
@@ -834,11 +989,14 @@ static int has_segment_link(mstate m, msegmentptr ss)
 
 /* -----------------------  Direct-mmapping chunks ----------------------- */
 
-static void *direct_alloc(size_t nb)
+static void *direct_alloc(mstate m, size_t nb)
 {
-  size_t mmsize = mmap_align(nb + SIX_SIZE_T_SIZES + CHUNK_ALIGN_MASK);
+  int mode = nb >= HUGE_PAGESIZE ? m->mode : 0;  /* Don't waste huge pages. */
+  size_t mmsize = is_hugemode(mode) ?
+    huge_align(nb + SIX_SIZE_T_SIZES + CHUNK_ALIGN_MASK) :
+    mmap_align(nb + SIX_SIZE_T_SIZES + CHUNK_ALIGN_MASK);
   if (LJ_LIKELY(mmsize > nb)) {     /* Check for wrap around 0 */
-    char *mm = (char *)(DIRECT_MMAP(mmsize));
+    char *mm = (char *)(mspace_mmap(mmsize, mode, m->node, 1));
     if (mm != CMFAIL) {
       size_t offset = align_offset(chunk2mem(mm));
       size_t psize = mmsize - offset - DIRECT_FOOT_PAD;
@@ -847,13 +1005,14 @@ static void *direct_alloc(size_t nb)
       p->head = psize|CINUSE_BIT;
       chunk_plus_offset(p, psize)->head = FENCEPOST_HEAD;
       chunk_plus_offset(p, psize+SIZE_T_SIZE)->head = 0;
+      m->directsize += mmsize;
       return chunk2mem(p);
     }
   }
   return NULL;
 }
 
-static mchunkptr direct_resize(mchunkptr oldp, size_t nb)
+static mchunkptr direct_resize(mstate m, mchunkptr oldp, size_t nb)
 {
   size_t oldsize = chunksize(oldp);
   if (is_small(nb)) /* Can't shrink direct regions below small size */
@@ -874,6 +1033,7 @@ static mchunkptr direct_resize(mchunkptr oldp, size_t nb)
       newp->head = psize|CINUSE_BIT;
       chunk_plus_offset(newp, psize)->head = FENCEPOST_HEAD;
       chunk_plus_offset(newp, psize+SIZE_T_SIZE)->head = 0;
+      m->directsize += newmmsize - oldmmsize;
       return newp;
     }
   }
@@ -998,16 +1158,16 @@ static void *alloc_sys(mstate m, size_t nb)
 
   /* Directly map large chunks */
   if (LJ_UNLIKELY(nb >= DEFAULT_MMAP_THRESHOLD)) {
-    void *mem = direct_alloc(nb);
+    void *mem = direct_alloc(m, nb);
     if (mem != 0)
       return mem;
   }
 
   {
     size_t req = nb + TOP_FOOT_SIZE + SIZE_T_ONE;
-    size_t rsize = granularity_align(req);
+    size_t rsize = mspace_align(m, req);
     if (LJ_LIKELY(rsize > nb)) { /* Fail if wraps around zero */
-      char *mp = (char *)(CALL_MMAP(rsize));
+      char *mp = (char *)(mspace_mmap(rsize, m->mode, m->node, 0));
       if (mp != CMFAIL) {
 	tbase = mp;
 	tsize = rsize;
@@ -1078,6 +1238,8 @@ static size_t release_unused_segments(mstate m)
 	}
 	if (CALL_MUNMAP(base, size) == 0) {
 	  released += size;
+	  m->nrelease++;
+	  m->released += size;
 	  /* unlink obsoleted record */
 	  sp = pred;
 	  sp->next = next;
@@ -1103,7 +1265,7 @@ static int alloc_trim(mstate m, size_t pad)
 
     if (m->topsize > pad) {
       /* Shrink top space in granularity-size units, keeping at least one */
-      size_t unit = DEFAULT_GRANULARITY;
+      size_t unit = m->granularity;
       size_t extra = ((m->topsize - pad + (unit - SIZE_T_ONE)) / unit -
 		      SIZE_T_ONE) * unit;
       msegmentptr sp = segment_holding(m, (char *)m->top);
@@ -1119,6 +1281,8 @@ static int alloc_trim(mstate m, size_t pad)
       }
 
       if (released != 0) {
+	m->ntrim++;
+	m->trimmed += released;
 	sp->size -= released;
 	init_top(m, m->top, m->topsize - released);
       }
@@ -1236,10 +1400,23 @@ static void *tmalloc_small(mstate m, size_t nb)
 
 void *lj_alloc_create(void)
 {
-  size_t tsize = DEFAULT_GRANULARITY;
+  return lj_alloc_createx(0, 0, -1);
+}
+
+/*
+** Create an mspace with a segment granularity of at least gsize bytes
+** (0: default), an allocation mode and a preferred NUMA node (-1: none).
+** Huge pages are best-effort: without a hugetlb pool or THP support, the
+** mappings silently fall back to regular pages.
+*/
+void *lj_alloc_createx(size_t gsize, int mode, int node)
+{
+  size_t tsize = is_hugemode(mode) ? HUGE_PAGESIZE : DEFAULT_GRANULARITY;
   char *tbase;
+  while (tsize < gsize && tsize < (MAX_SIZE_T >> 2))  /* Round to power of 2. */
+    tsize <<= 1;
   INIT_MMAP();
-  tbase = (char *)(CALL_MMAP(tsize));
+  tbase = (char *)(mspace_mmap(tsize, mode, node, 0));
   if (tbase != CMFAIL) {
     size_t msize = pad_request(sizeof(struct malloc_state));
     mchunkptr mn;
@@ -1250,6 +1427,9 @@ void *lj_alloc_create(void)
     m->seg.base = tbase;
     m->seg.size = tsize;
     m->release_checks = MAX_RELEASE_CHECK_RATE;
+    m->granularity = tsize;
+    m->mode = mode;
+    m->node = node;
     init_bins(m);
     mn = next_chunk(mem2chunk(m));
     init_top(m, mn, (size_t)((tbase + tsize) - (char *)mn) - TOP_FOOT_SIZE);
@@ -1365,7 +1545,8 @@ static LJ_NOINLINE void *lj_alloc_free(void *msp, void *ptr)
       if ((prevsize & IS_DIRECT_BIT) != 0) {
 	prevsize &= ~IS_DIRECT_BIT;
 	psize += prevsize + DIRECT_FOOT_PAD;
-	CALL_MUNMAP((char *)p - prevsize, psize);
+	if (CALL_MUNMAP((char *)p - prevsize, psize) == 0)
+	  fm->directsize -= psize;
 	return NULL;
       } else {
 	mchunkptr prev = chunk_minus_offset(p, prevsize);
@@ -1438,7 +1619,7 @@ static LJ_NOINLINE void *lj_alloc_realloc(void *msp, void *ptr, size_t nsize)
 
     /* Try to either shrink or extend into top. Else malloc-copy-free */
     if (is_direct(oldp)) {
-      newp = direct_resize(oldp, nb);  /* this may return NULL. */
+      newp = direct_resize(m, oldp, nb);  /* this may return NULL. */
     } else if (oldsize >= nb) { /* already big enough */
       size_t rsize = oldsize - nb;
       newp = oldp;
@@ -1474,16 +1655,237 @@ static LJ_NOINLINE void *lj_alloc_realloc(void *msp, void *ptr, size_t nsize)
   }
 }
 
+/* Get a SLAB_SIZE aligned chunk. Derived from dlmalloc's memalign. */
+static void *slab_memalign(mstate m)
+{
+  size_t nb = request2size(SLAB_SIZE);
+  char *mem = (char *)lj_alloc_malloc(m, nb + SLAB_SIZE + MIN_CHUNK_SIZE -
+					 CHUNK_OVERHEAD);
+  if (mem != 0) {
+    void *leader = 0, *trailer = 0;
+    mchunkptr p = mem2chunk(mem);
+    if (((size_t)mem & (SLAB_SIZE-1)) != 0) {  /* Misaligned: split off lead. */
+      char *br = (char *)mem2chunk(((size_t)mem + SLAB_SIZE-1) &
+				   ~(SLAB_SIZE-1));
+      char *pos = (size_t)(br - (char *)p) >= MIN_CHUNK_SIZE ? br :
+							      br + SLAB_SIZE;
+      mchunkptr newp = (mchunkptr)pos;
+      size_t leadsize = (size_t)(pos - (char *)p);
+      size_t newsize = chunksize(p) - leadsize;
+      if (is_direct(p)) {
+	newp->prev_foot = p->prev_foot + leadsize;
+	newp->head = newsize|CINUSE_BIT;
+      } else {
+	set_inuse(m, newp, newsize);
+	set_inuse(m, p, leadsize);
+	leader = chunk2mem(p);
+      }
+      p = newp;
+    }
+    if (!is_direct(p)) {  /* Split off the trailing space. */
+      size_t size = chunksize(p);
+      if (size > nb + MIN_CHUNK_SIZE) {
+	size_t remsize = size - nb;
+	mchunkptr rem = chunk_plus_offset(p, nb);
+	set_inuse(m, p, nb);
+	set_inuse(m, rem, remsize);
+	trailer = chunk2mem(rem);
+      }
+    }
+    if (leader) lj_alloc_free(m, leader);
+    if (trailer) lj_alloc_free(m, trailer);
+    return chunk2mem(p);
+  }
+  return NULL;
+}
+
+static void slab_link(mstate m, slab *s, size_t c)
+{
+  s->prev = NULL;
+  s->next = m->slabs[c];
+  if (s->next) s->next->prev = s;
+  m->slabs[c] = s;
+}
+
+static void slab_unlink(mstate m, slab *s, size_t c)
+{
+  if (s->prev) s->prev->next = s->next; else m->slabs[c] = s->next;
+  if (s->next) s->next->prev = s->prev;
+}
+
+static LJ_AINLINE void *slab_malloc(mstate m, size_t nsize)
+{
+  size_t c = slab_class(nsize), sz = slab_class2size(c);
+  slab *s = m->slabs[c];
+  void *mem;
+  if (LJ_UNLIKELY(s == NULL)) {  /* Need a new slab. */
+    s = (slab *)slab_memalign(m);
+    if (s == NULL) return NULL;
+    s->free = NULL;
+    s->bump = slab_first(s);
+    s->nused = 0;
+    slab_link(m, s, c);
+  }
+  if ((mem = s->free) != NULL) {
+    s->free = *(void **)mem;
+  } else {
+    mem = s->bump;
+    s->bump += sz;
+  }
+  s->nused++;
+  if (slab_isfull(s, sz))
+    slab_unlink(m, s, c);
+  return mem;
+}
+
+static LJ_AINLINE void slab_free(mstate m, void *ptr, size_t osize)
+{
+  size_t c = slab_class(osize), sz = slab_class2size(c);
+  slab *s = slab_of(ptr);
+  if (slab_isfull(s, sz))
+    slab_link(m, s, c);
+  *(void **)ptr = s->free;
+  s->free = ptr;
+  if (--s->nused == 0 && (s->prev || s->next)) {  /* Keep the last slab. */
+    slab_unlink(m, s, c);
+    lj_alloc_free(m, s);
+  }
+}
+
+/* Move a block into or out of a slab, or between size classes. */
+static LJ_NOINLINE void *slab_realloc(mstate m, void *ptr, size_t osize,
+				      size_t nsize)
+{
+  void *mem;
+  if (osize <= SLAB_MAXSIZE && nsize <= SLAB_MAXSIZE &&
+      slab_class(osize) == slab_class(nsize))
+    return ptr;
+  mem = nsize <= SLAB_MAXSIZE ? slab_malloc(m, nsize) :
+				lj_alloc_malloc(m, nsize);
+  if (mem != NULL) {
+    memcpy(mem, ptr, osize < nsize ? osize : nsize);
+    if (osize <= SLAB_MAXSIZE)
+      slab_free(m, ptr, osize);
+    else
+      lj_alloc_free(m, ptr);
+  }
+  return mem;
+}
+
 void *lj_alloc_f(void *msp, void *ptr, size_t osize, size_t nsize)
 {
-  (void)osize;
   if (nsize == 0) {
+    if (ptr != NULL && osize <= SLAB_MAXSIZE) {
+      slab_free((mstate)msp, ptr, osize);
+      return NULL;
+    }
     return lj_alloc_free(msp, ptr);
   } else if (ptr == NULL) {
+    if (nsize <= SLAB_MAXSIZE)
+      return slab_malloc((mstate)msp, nsize);
     return lj_alloc_malloc(msp, nsize);
+  } else if (osize <= SLAB_MAXSIZE || nsize <= SLAB_MAXSIZE) {
+    return slab_realloc((mstate)msp, ptr, osize, nsize);
   } else {
     return lj_alloc_realloc(msp, ptr, nsize);
   }
 }
 
+/* Discard the whole pages inside a free chunk. Returns their size. */
+static size_t discard_chunk(mchunkptr p, size_t psize)
+{
+  size_t start = page_align((size_t)p + sizeof(struct malloc_tree_chunk));
+  size_t end = ((size_t)p + psize) & ~(LJ_PAGESIZE - SIZE_T_ONE);
+  if (end > start) {
+    CALL_DISCARD((void *)start, end - start);
+    return end - start;
+  }
+  return 0;
+}
+
+/*
+** Return as much free memory to the OS as possible. Frees empty slabs,
+** shrinks the top segment, unmaps unused segments and discards the pages
+** of all remaining free chunks. Returns the number of bytes released.
+*/
+size_t lj_alloc_trim(void *msp)
+{
+  mstate m = (mstate)msp;
+  size_t released = m->trimmed + m->released;
+  size_t trim_check = m->trim_check;
+  msegmentptr sp;
+  size_t c;
+  for (c = 0; c < SLAB_NCLASS; c++) {
+    slab *s = m->slabs[c];
+    while (s != NULL) {
+      slab *next = s->next;
+      if (s->nused == 0) {
+	slab_unlink(m, s, c);
+	lj_alloc_free(m, s);
+      }
+      s = next;
+    }
+  }
+  alloc_trim(m, 0);
+  m->trim_check = trim_check;  /* Don't let a failure disable autotrim. */
+  released = m->trimmed + m->released - released;
+  for (sp = &m->seg; sp != 0; sp = sp->next) {
+    mchunkptr q = align_as_chunk(sp->base);
+    while (segment_holds(sp, q) && q->head != FENCEPOST_HEAD) {
+      if (q == m->top) {
+	released += discard_chunk(q, m->topsize);
+	break;
+      }
+      if (!cinuse(q))
+	released += discard_chunk(q, chunksize(q));
+      q = next_chunk(q);
+    }
+  }
+  return released;
+}
+
+/* Collect statistics about an mspace. Walks all segments. */
+void lj_alloc_stats(void *msp, LJAllocStats *st)
+{
+  mstate m = (mstate)msp;
+  msegmentptr sp;
+  size_t c;
+  memset(st, 0, sizeof(LJAllocStats));
+  st->direct = m->directsize;
+  st->mapped = m->directsize;
+  st->topsize = m->topsize;
+  st->dvsize = m->dvsize;
+  st->ntrim = m->ntrim;
+  st->trimmed = m->trimmed;
+  st->nrelease = m->nrelease;
+  st->released = m->released;
+  for (sp = &m->seg; sp != 0; sp = sp->next) {
+    mchunkptr q = align_as_chunk(sp->base);
+    st->nseg++;
+    st->mapped += sp->size;
+    while (segment_holds(sp, q) && q != m->top && q->head != FENCEPOST_HEAD) {
+      size_t sz = chunksize(q);
+      if (!cinuse(q) && q != m->dv) {
+	if (is_small(sz)) {
+	  st->smallfree[small_index(sz)] += sz;
+	} else {
+	  bindex_t i;
+	  compute_tree_index(sz, i);
+	  st->treefree[i] += sz;
+	}
+      }
+      q = next_chunk(q);
+    }
+  }
+  for (c = 0; c < SLAB_NCLASS; c++) {
+    size_t sz = slab_class2size(c);
+    slab *s;
+    for (s = m->slabs[c]; s != NULL; s = s->next) {
+      size_t cap = (size_t)((char *)s + SLAB_SIZE - slab_first(s)) / sz;
+      st->nslab++;
+      st->slabfree += (cap - s->nused) * sz;
+    }
+  }
+}
+
 #endif
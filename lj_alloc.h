@@ -8,10 +8,36 @@
 
 #include "lj_def.h"
 
+/* Allocation modes for lj_alloc_createx. Same values as LUAJIT_ALLOC_*. */
+#define LJ_ALLOCMODE_HUGEPAGE	0x0001	/* Transparent huge pages. */
+#define LJ_ALLOCMODE_HUGETLB	0x0002	/* Explicit huge pages, if reserved. */
+
+#define LJ_ALLOC_NBINS		32	/* Number of small and of tree bins. */
+
+/* Statistics about an mspace, see lj_alloc_stats. All sizes in bytes. */
+typedef struct LJAllocStats {
+  size_t mapped;		/* Memory mapped from the OS. */
+  size_t direct;		/* Part of mapped held by direct chunks. */
+  size_t nseg;			/* Number of segments. */
+  size_t topsize;		/* Size of the top chunk. */
+  size_t dvsize;		/* Size of the designated victim chunk. */
+  size_t smallfree[LJ_ALLOC_NBINS];  /* Free bytes per small bin. */
+  size_t treefree[LJ_ALLOC_NBINS];   /* Free bytes per tree bin. */
+  size_t nslab;			/* Number of slabs with free objects. */
+  size_t slabfree;		/* Free bytes in these slabs. */
+  size_t ntrim;			/* Number of times the top segment was shrunk. */
+  size_t trimmed;		/* Bytes returned by shrinking the top segment. */
+  size_t nrelease;		/* Number of unmapped unused segments. */
+  size_t released;		/* Bytes returned by unmapping unused segments. */
+} LJAllocStats;
+
 #ifndef LUAJIT_USE_SYSMALLOC
 LJ_FUNC void *lj_alloc_create(void);
+LJ_FUNC void *lj_alloc_createx(size_t gsize, int mode, int node);
 LJ_FUNC void lj_alloc_destroy(void *msp);
 LJ_FUNC void *lj_alloc_f(void *msp, void *ptr, size_t osize, size_t nsize);
+LJ_FUNC void lj_alloc_stats(void *msp, LJAllocStats *st);
+LJ_FUNC size_t lj_alloc_trim(void *msp);
 #endif
 
 #endif
@@ -11,6 +11,7 @@
 
 #include "lj_bc.h"
 #include "lj_debug.h"
+#include "lj_dispatch.h"
 #include "lj_err.h"
 #include "lj_frame.h"
 #include "lj_func.h"
@@ -24,7 +25,12 @@
 #include "lj_tab.h"
 #include "lj_trace.h"
 #include "lj_udata.h"
+#include "luajit.h"
 #include "lj_vm.h"
+#include "lj_alloc.h"
+#if LJ_HASGCTHREAD
+#include "lj_gcthread.h"
+#endif
 
 #include <stdarg.h>
 
@@ -933,6 +939,8 @@ LUA_API void lua_rawseti(lua_State *L, int idx, int n) {
     GCtab *t = tabV(index2adr(L, idx));
     TValue *dst, *src;
     api_checknelems(L, 1);
+    if (LJ_UNLIKELY(tabisfrozen(t)))
+        lj_err_msg(L, LJ_ERR_TABRO);
     dst = lj_tab_setint(L, t, n);
     src = L->top - 1;
     copyTV(L, dst, src);
@@ -1155,6 +1163,118 @@ LUA_API int lua_resume(lua_State *L, int nargs) {
 
 /* -- GC and memory management -------------------------------------------- */
 
+static void api_setstat(lua_State *L, const char *k, uint64_t v) {
+    lua_pushnumber(L, (lua_Number)v);
+    lua_setfield(L, -2, k);
+}
+
+/* Push a table with the GC telemetry. Optionally reset the counters. */
+LUA_API void luaJIT_gcstats(lua_State *L, int reset) {
+    static const char *const phasename[] = {
+#define GCPHASENAME(name)	#name,
+        GCPHASEDEF(GCPHASENAME)
+#undef GCPHASENAME
+    };
+    GCStats *st = &L2GG(L)->gcstats;
+    int i;
+    lj_state_checkstack(L, 4);
+    lua_createtable(L, 0, 11);
+    api_setstat(L, "minor", st->minor);
+    api_setstat(L, "major", st->major);
+    api_setstat(L, "pauses", st->pauses);
+    api_setstat(L, "freedyoung", st->freedyoung);
+    api_setstat(L, "freedold", st->freedold);
+    api_setstat(L, "promoted", st->promoted);
+    api_setstat(L, "pausens", st->pausens);
+    api_setstat(L, "maxpausens", st->maxpausens);
+    lua_createtable(L, GC_PAUSEHIST, 0);
+    for (i = 0; i < GC_PAUSEHIST; i++) {
+        lua_pushnumber(L, (lua_Number)st->pausehist[i]);
+        lua_rawseti(L, -2, i+1);
+    }
+    lua_setfield(L, -2, "pausehist");
+    lua_createtable(L, 0, GCPHASE__MAX);
+    for (i = 0; i < GCPHASE__MAX; i++) {
+        lua_createtable(L, 0, 3);
+        api_setstat(L, "ns", st->phases[i].ns);
+        api_setstat(L, "num", st->phases[i].num);
+        api_setstat(L, "maxns", st->phases[i].maxns);
+        lua_setfield(L, -2, phasename[i]);
+    }
+    lua_setfield(L, -2, "phases");
+    if (reset)  /* Keep the clock of a running pause. */
+        memset(&st->minor, 0, sizeof(GCStats) - offsetof(GCStats, minor));
+}
+
+/* Push a table with allocator and per-type heap statistics. */
+LUA_API void luaJIT_allocstats(lua_State *L) {
+    global_State *g = G(L);
+    GCSize bytes[LJ_GC_NTYPES], num[LJ_GC_NTYPES];
+    int i;
+    lj_state_checkstack(L, 4);
+    lua_createtable(L, 0, 16);
+    api_setstat(L, "gctotal", g->gc.total);
+#ifndef LUAJIT_USE_SYSMALLOC
+    {
+        void *ud = g->allocd;
+        lua_Alloc f = g->allocf;
+#if LJ_HASGCTHREAD
+        if (lj_gcthread_active(g))
+            f = lj_gcthread_getallocf(g, &ud);
+#endif
+        if (f == lj_alloc_f) {  /* Only the bundled allocator has stats. */
+            LJAllocStats st;
+            size_t freebytes;
+#if LJ_HASGCTHREAD
+            if (lj_gcthread_active(g)) {
+                lj_gcthread_flush(g);
+                lj_gcthread_lock(g);
+                lj_alloc_stats(ud, &st);
+                lj_gcthread_unlock(g);
+            } else
+#endif
+            lj_alloc_stats(ud, &st);
+            freebytes = st.dvsize + st.slabfree;
+            api_setstat(L, "mapped", st.mapped);
+            api_setstat(L, "direct", st.direct);
+            api_setstat(L, "segments", st.nseg);
+            api_setstat(L, "top", st.topsize);
+            api_setstat(L, "dv", st.dvsize);
+            api_setstat(L, "slabs", st.nslab);
+            api_setstat(L, "slabfree", st.slabfree);
+            api_setstat(L, "trims", st.ntrim);
+            api_setstat(L, "trimmed", st.trimmed);
+            api_setstat(L, "releases", st.nrelease);
+            api_setstat(L, "released", st.released);
+            lua_createtable(L, LJ_ALLOC_NBINS, 0);
+            for (i = 0; i < LJ_ALLOC_NBINS; i++) {
+                freebytes += st.smallfree[i];
+                lua_pushnumber(L, (lua_Number)st.smallfree[i]);
+                lua_rawseti(L, -2, i+1);
+            }
+            lua_setfield(L, -2, "smallbins");
+            lua_createtable(L, LJ_ALLOC_NBINS, 0);
+            for (i = 0; i < LJ_ALLOC_NBINS; i++) {
+                freebytes += st.treefree[i];
+                lua_pushnumber(L, (lua_Number)st.treefree[i]);
+                lua_rawseti(L, -2, i+1);
+            }
+            lua_setfield(L, -2, "treebins");
+            api_setstat(L, "free", freebytes);
+        }
+    }
+#endif
+    lj_gc_heapstats(g, bytes, num);
+    lua_createtable(L, 0, LJ_GC_NTYPES - ~LJ_TSTR);
+    for (i = ~LJ_TSTR; i < LJ_GC_NTYPES; i++) {
+        lua_createtable(L, 0, 2);
+        api_setstat(L, "bytes", bytes[i]);
+        api_setstat(L, "count", num[i]);
+        lua_setfield(L, -2, lj_obj_itypename[i]);
+    }
+    lua_setfield(L, -2, "types");
+}
+
 LUA_API int lua_gc(lua_State *L, int what, ...) {
     va_list argp;
     va_start(argp, what);
@@ -1205,7 +1325,7 @@ LUA_API int lua_gc(lua_State *L, int what, ...) {
         res = (g->gc.threshold != LJ_MAX_MEM);
         break;
     case LUA_GCGEN: {
-        int oldmode = g->gc.kind;
+        int oldmode = g->gc.kind == KGC_INC ? KGC_INC : KGC_GEN;
         int minormul = va_arg(argp, int);
         int majormul = va_arg(argp, int);
         if (minormul != 0)
@@ -1217,7 +1337,7 @@ LUA_API int lua_gc(lua_State *L, int what, ...) {
         break;
     }
     case LUA_GCINC: {
-        int oldmode = g->gc.kind;
+        int oldmode = g->gc.kind == KGC_INC ? KGC_INC : KGC_GEN;
         int pause = va_arg(argp, int);
         int stepmul = va_arg(argp, int);
         if (pause != 0)
@@ -1228,6 +1348,56 @@ LUA_API int lua_gc(lua_State *L, int what, ...) {
         res = (oldmode == KGC_GEN)? LUA_GCGEN : LUA_GCINC;
         break;
     }
+    case LUA_GCSETGENSTEPMUL: {
+        int data = va_arg(argp, int);
+        res = (int)(g->gc.genstepmul);
+        g->gc.genstepmul = (MSize)(data < 0 ? 0 : data);
+        break;
+    }
+    case LUA_GCSETGENBADMUL: {
+        int data = va_arg(argp, int);
+        res = (int)(g->gc.genbadmul);
+        g->gc.genbadmul = (uint8_t)(data < 0 ? 0 : data > 100 ? 100 : data);
+        break;
+    }
+    case LUA_GCSETGENSTABLEMUL: {
+        int data = va_arg(argp, int);
+        res = (int)(g->gc.genstablemul);
+        g->gc.genstablemul = (uint8_t)(data < 0 ? 0 : data > 255 ? 255 : data);
+        break;
+    }
+    case LUA_GCTRIM:
+        res = (int)(lj_gc_trim(g) >> 10);  /* Released KB, like LUA_GCCOUNT. */
+        break;
+    case LUA_GCSETAUTOTRIM: {
+        int data = va_arg(argp, int);
+        res = g->gc.autotrim;
+        g->gc.autotrim = (data != 0);
+        break;
+    }
+    case LUA_GCSETNURSERY: {
+        int data = va_arg(argp, int);
+        res = lj_gc_setnursery(L, data);
+        break;
+    }
+    case LUA_GCSETMARKERS: {
+        int data = va_arg(argp, int);
+        res = lj_gc_setmarkers(L, data);
+        break;
+    }
+    case LUA_GCSETBGFREE: {
+        int data = va_arg(argp, int);
+#if LJ_HASGCTHREAD
+        res = lj_gcthread_active(g);
+        if (!data)
+            lj_gcthread_stop(g);
+        else if (!lj_gcthread_start(g))
+            res = -1; /* Thread creation failed. */
+#else
+        UNUSED(data);
+#endif
+        break;
+    }
     default:
         res = -1; /* Invalid option. */
     }
@@ -1237,6 +1407,7 @@ LUA_API int lua_gc(lua_State *L, int what, ...) {
 
 LUA_API lua_Alloc lua_getallocf(lua_State *L, void **ud) {
     global_State *g = G(L);
+    /* With a GC thread this is its wrapper, which locks the allocator. */
     if (ud)
         *ud = g->allocd;
     return g->allocf;
@@ -1244,6 +1415,11 @@ LUA_API lua_Alloc lua_getallocf(lua_State *L, void **ud) {
 
 LUA_API void lua_setallocf(lua_State *L, lua_Alloc f, void *ud) {
     global_State *g = G(L);
+#if LJ_HASGCTHREAD
+    if (f == g->allocf && ud == g->allocd)
+        return; /* Restoring the wrapper from lua_getallocf. */
+    lj_gcthread_stop(g);
+#endif
     g->allocd = ud;
     g->allocf = f;
 }
@@ -505,6 +505,13 @@
 #define LJ_HASPROFILE		0
 #endif
 
+/* Background thread for freeing dead objects. Opt-in, needs pthreads. */
+#if defined(LUAJIT_USE_GCTHREAD) && LJ_TARGET_POSIX
+#define LJ_HASGCTHREAD		1
+#else
+#define LJ_HASGCTHREAD		0
+#endif
+
 #ifndef LJ_ARCH_HASFPU
 #define LJ_ARCH_HASFPU		1
 #endif
@@ -834,6 +834,7 @@ static void asm_href(ASMState *as, IRIns *ir, IROp merge)
 	emit_d(as, ARMF_CC(ARMI_MOV, CC_EQ)|ARMI_K12|0, keyhi);
       }
       emit_dnm(as, ARMI_AND, tmp, tmp, RID_TMP);
+      emit_dnm(as, ARMI_EOR|ARMF_SH(ARMSH_LSR, HASH_FOLD), tmp, tmp, tmp);
       emit_dnm(as, ARMI_SUB|ARMF_SH(ARMSH_ROR, 32-HASH_ROT3), tmp, tmp, tmp+1);
       emit_lso(as, ARMI_LDR, dest, tab, (int32_t)offsetof(GCtab, node));
       emit_dnm(as, ARMI_EOR|ARMF_SH(ARMSH_ROR, 32-((HASH_ROT2+HASH_ROT1)&31)),
@@ -1282,13 +1283,33 @@ static void asm_tbar(ASMState *as, IRIns *ir)
 		     rset_exclude(rset_exclude(RSET_GPR, tab), link));
   Reg mark = RID_TMP;
   MCLabel l_end = emit_label(as);
+  MCLabel l_full;
+  /* Remembered set is full, use grayagain instead. */
   emit_lso(as, ARMI_STR, link, tab, (int32_t)offsetof(GCtab, gclist));
-  emit_lso(as, ARMI_STRB, mark, tab, (int32_t)offsetof(GCtab, marked));
   emit_lso(as, ARMI_STR, tab, gr,
 	   (int32_t)offsetof(global_State, gc.grayagain));
-  emit_dn(as, ARMI_BIC|ARMI_K12|LJ_GC_BLACK, mark, mark);
   emit_lso(as, ARMI_LDR, link, gr,
 	   (int32_t)offsetof(global_State, gc.grayagain));
+  l_full = emit_label(as);
+  emit_jmp(as, l_end);
+  emit_lso(as, ARMI_STR, link, gr,
+	   (int32_t)offsetof(global_State, gc.remsettop));
+  emit_dn(as, ARMI_ADD|ARMI_K12|(int32_t)sizeof(GCRef), link, link);
+  emit_lso(as, ARMI_STR, tab, link, 0);
+  emit_branch(as, ARMF_CC(ARMI_B, CC_HS), l_full);
+  emit_nm(as, ARMI_CMP, link, mark);
+  emit_lso(as, ARMI_LDR, mark, gr,
+	   (int32_t)offsetof(global_State, gc.remsetlim));
+  emit_lso(as, ARMI_LDR, link, gr,
+	   (int32_t)offsetof(global_State, gc.remsettop));
+  /* Already remembered if G_TOUCHED2. */
+  emit_branch(as, ARMF_CC(ARMI_B, CC_EQ), l_end);
+  emit_lso(as, ARMI_STRB, mark, tab, (int32_t)offsetof(GCtab, age));
+  emit_d(as, ARMI_MOV|ARMI_K12|G_TOUCHED1, mark);
+  emit_n(as, ARMI_CMP|ARMI_K12|G_TOUCHED2, mark);
+  emit_lso(as, ARMI_LDRB, mark, tab, (int32_t)offsetof(GCtab, age));
+  emit_lso(as, ARMI_STRB, mark, tab, (int32_t)offsetof(GCtab, marked));
+  emit_dn(as, ARMI_BIC|ARMI_K12|LJ_GC_BLACK, mark, mark);
   emit_branch(as, ARMF_CC(ARMI_B, CC_EQ), l_end);
   emit_n(as, ARMI_TST|ARMI_K12|LJ_GC_BLACK, mark);
   emit_lso(as, ARMI_LDRB, mark, tab, (int32_t)offsetof(GCtab, marked));
@@ -838,6 +838,7 @@ static void asm_href(ASMState *as, IRIns *ir, IROp merge)
     } else {  /* Must match with hash*() in lj_tab.c. */
       emit_dnm(as, A64I_ANDw, dest, dest, tmp);
       emit_lso(as, A64I_LDRw, tmp, tab, offsetof(GCtab, hmask));
+      emit_dnm(as, A64I_EORw | A64F_SH(A64SH_LSR, HASH_FOLD), dest, dest, dest);
       emit_dnm(as, A64I_SUBw, dest, dest, tmp);
       emit_dnm(as, A64I_EXTRw | (A64F_IMMS(32-HASH_ROT3)), tmp, tmp, tmp);
       emit_dnm(as, A64I_EORw, dest, dest, tmp);
@@ -1245,13 +1246,33 @@ static void asm_tbar(ASMState *as, IRIns *ir)
 		     rset_exclude(rset_exclude(RSET_GPR, tab), link));
   Reg mark = RID_TMP;
   MCLabel l_end = emit_label(as);
+  MCLabel l_full;
+  /* Remembered set is full, use grayagain instead. */
   emit_lso(as, A64I_STRx, link, tab, (int32_t)offsetof(GCtab, gclist));
-  emit_lso(as, A64I_STRB, mark, tab, (int32_t)offsetof(GCtab, marked));
   emit_lso(as, A64I_STRx, tab, gr,
 	   (int32_t)offsetof(global_State, gc.grayagain));
-  emit_dn(as, A64I_ANDw^emit_isk13(~LJ_GC_BLACK, 0), mark, mark);
   emit_lso(as, A64I_LDRx, link, gr,
 	   (int32_t)offsetof(global_State, gc.grayagain));
+  l_full = emit_label(as);
+  emit_jmp(as, l_end);
+  emit_lso(as, A64I_STRx, link, gr,
+	   (int32_t)offsetof(global_State, gc.remsettop));
+  emit_dn(as, (A64I_ADDx^A64I_K12) | A64F_U12(sizeof(GCRef)), link, link);
+  emit_lso(as, A64I_STRx, tab, link, 0);
+  emit_cond_branch(as, CC_HS, l_full);
+  emit_nm(as, A64I_CMPx, link, mark);
+  emit_lso(as, A64I_LDRx, mark, gr,
+	   (int32_t)offsetof(global_State, gc.remsetlim));
+  emit_lso(as, A64I_LDRx, link, gr,
+	   (int32_t)offsetof(global_State, gc.remsettop));
+  /* Already remembered if G_TOUCHED2. */
+  emit_cond_branch(as, CC_EQ, l_end);
+  emit_lso(as, A64I_STRB, mark, tab, (int32_t)offsetof(GCtab, age));
+  emit_d(as, A64I_MOVZw | A64F_U16(G_TOUCHED1), mark);
+  emit_n(as, (A64I_CMPw^A64I_K12) | A64F_U12(G_TOUCHED2), mark);
+  emit_lso(as, A64I_LDRB, mark, tab, (int32_t)offsetof(GCtab, age));
+  emit_lso(as, A64I_STRB, mark, tab, (int32_t)offsetof(GCtab, marked));
+  emit_dn(as, A64I_ANDw^emit_isk13(~LJ_GC_BLACK, 0), mark, mark);
   emit_cond_branch(as, CC_EQ, l_end);
   emit_n(as, A64I_TSTw^emit_isk13(LJ_GC_BLACK, 0), mark);
   emit_lso(as, A64I_LDRB, mark, tab, (int32_t)offsetof(GCtab, marked));
@@ -928,6 +928,8 @@ static void asm_href(ASMState *as, IRIns *ir, IROp merge)
     } else if (irt_isstr(kt)) {
       emit_tsi(as, MIPSI_LW, tmp1, key, (int32_t)offsetof(GCstr, hash));
     } else {  /* Must match with hash*() in lj_tab.c. */
+      emit_dst(as, MIPSI_XOR, tmp1, tmp1, tmp2);
+      emit_dta(as, MIPSI_SRL, tmp2, tmp1, HASH_FOLD);
       emit_dst(as, MIPSI_SUBU, tmp1, tmp1, tmp2);
       emit_rotr(as, tmp2, tmp2, dest, (-HASH_ROT3)&31);
       emit_dst(as, MIPSI_XOR, tmp1, tmp1, tmp2);
@@ -1496,10 +1498,27 @@ static void asm_tbar(ASMState *as, IRIns *ir)
   Reg mark = ra_scratch(as, rset_exclude(RSET_GPR, tab));
   Reg link = RID_TMP;
   MCLabel l_end = emit_label(as);
+  MCLabel l_full;
+  /* Remembered set is full, use grayagain instead. */
   emit_tsi(as, MIPSI_AS, link, tab, (int32_t)offsetof(GCtab, gclist));
-  emit_tsi(as, MIPSI_SB, mark, tab, (int32_t)offsetof(GCtab, marked));
   emit_setgl(as, tab, gc.grayagain);
   emit_getgl(as, link, gc.grayagain);
+  l_full = emit_label(as);
+  emit_setgl(as, link, gc.remsettop);
+  emit_branch(as, MIPSI_B, RID_ZERO, RID_ZERO, l_end);
+  emit_tsi(as, MIPSI_AS, tab, mark, 0);
+  emit_tsi(as, MIPSI_AADDIU, link, mark, (int32_t)sizeof(GCRef));
+  emit_branch(as, MIPSI_BEQ, link, RID_ZERO, l_full);
+  emit_dst(as, MIPSI_SLTU, link, mark, link);
+  emit_getgl(as, link, gc.remsetlim);
+  emit_getgl(as, mark, gc.remsettop);
+  emit_tsi(as, MIPSI_SB, mark, tab, (int32_t)offsetof(GCtab, age));
+  /* Already remembered if G_TOUCHED2. */
+  emit_branch(as, MIPSI_BEQ, RID_TMP, RID_ZERO, l_end);
+  emit_tsi(as, MIPSI_ADDIU, mark, RID_ZERO, G_TOUCHED1);
+  emit_tsi(as, MIPSI_XORI, RID_TMP, mark, G_TOUCHED2);
+  emit_tsi(as, MIPSI_LBU, mark, tab, (int32_t)offsetof(GCtab, age));
+  emit_tsi(as, MIPSI_SB, mark, tab, (int32_t)offsetof(GCtab, marked));
   emit_dst(as, MIPSI_XOR, mark, mark, RID_TMP);  /* Clear black bit. */
   emit_branch(as, MIPSI_BEQ, RID_TMP, RID_ZERO, l_end);
   emit_tsi(as, MIPSI_ANDI, RID_TMP, mark, LJ_GC_BLACK);
@@ -646,6 +646,8 @@ static void asm_href(ASMState *as, IRIns *ir, IROp merge)
     } else if (irt_isstr(kt)) {
       emit_tai(as, PPCI_LWZ, tmp1, key, (int32_t)offsetof(GCstr, hash));
     } else {  /* Must match with hash*() in lj_tab.c. */
+      emit_asb(as, PPCI_XOR, tmp1, tmp1, tmp2);
+      emit_rot(as, PPCI_RLWINM, tmp2, tmp1, 32-HASH_FOLD, HASH_FOLD, 31);
       emit_tab(as, PPCI_SUBF, tmp1, tmp2, tmp1);
       emit_rotlwi(as, tmp2, tmp2, HASH_ROT3);
       emit_asb(as, PPCI_XOR, tmp1, tmp1, tmp2);
@@ -1080,12 +1082,29 @@ static void asm_tbar(ASMState *as, IRIns *ir)
   Reg mark = ra_scratch(as, rset_exclude(RSET_GPR, tab));
   Reg link = RID_TMP;
   MCLabel l_end = emit_label(as);
+  MCLabel l_full;
+  /* Remembered set is full, use grayagain instead. */
   emit_tai(as, PPCI_STW, link, tab, (int32_t)offsetof(GCtab, gclist));
-  emit_tai(as, PPCI_STB, mark, tab, (int32_t)offsetof(GCtab, marked));
   emit_setgl(as, tab, gc.grayagain);
+  emit_getgl(as, link, gc.grayagain);
+  l_full = emit_label(as);
+  emit_jmp(as, l_end);
+  emit_setgl(as, mark, gc.remsettop);
+  emit_tai(as, PPCI_ADDI, mark, mark, (int32_t)sizeof(GCRef));
+  emit_tai(as, PPCI_STW, tab, mark, 0);
+  emit_condbranch(as, PPCI_BC, CC_GE, l_full);
+  emit_ab(as, PPCI_CMPLW, mark, link);
+  emit_getgl(as, link, gc.remsetlim);
+  emit_getgl(as, mark, gc.remsettop);
+  /* Already remembered if G_TOUCHED2. */
+  emit_condbranch(as, PPCI_BC|PPCF_Y, CC_EQ, l_end);
+  emit_tai(as, PPCI_STB, mark, tab, (int32_t)offsetof(GCtab, age));
+  emit_loadi(as, mark, G_TOUCHED1);
+  emit_ai(as, PPCI_CMPWI, mark, G_TOUCHED2);
+  emit_tai(as, PPCI_LBZ, mark, tab, (int32_t)offsetof(GCtab, age));
+  emit_tai(as, PPCI_STB, mark, tab, (int32_t)offsetof(GCtab, marked));
   lua_assert(LJ_GC_BLACK == 0x04);
   emit_rot(as, PPCI_RLWINM, mark, mark, 0, 30, 28);  /* Clear black bit. */
-  emit_getgl(as, link, gc.grayagain);
   emit_condbranch(as, PPCI_BC|PPCF_Y, CC_EQ, l_end);
   emit_asi(as, PPCI_ANDIDOT, RID_TMP, mark, LJ_GC_BLACK);
   emit_tai(as, PPCI_LBZ, mark, tab, (int32_t)offsetof(GCtab, marked));
@@ -1228,6 +1228,9 @@ static void asm_href(ASMState *as, IRIns *ir, IROp merge)
       emit_rmro(as, XO_MOV, dest, tab, offsetof(GCtab, hmask));
     } else {  /* Must match with hashrot() in lj_tab.c. */
       emit_rmro(as, XO_ARITH(XOg_AND), dest, tab, offsetof(GCtab, hmask));
+      emit_rr(as, XO_ARITH(XOg_XOR), dest, tmp);
+      emit_shifti(as, XOg_SHR, tmp, HASH_FOLD);
+      emit_rr(as, XO_MOV, tmp, dest);
       emit_rr(as, XO_ARITH(XOg_SUB), dest, tmp);
       emit_shifti(as, XOg_ROL, tmp, HASH_ROT3);
       emit_rr(as, XO_ARITH(XOg_XOR), dest, tmp);
@@ -1858,9 +1861,25 @@ static void asm_tbar(ASMState *as, IRIns *ir)
   Reg tab = ra_alloc1(as, ir->op1, RSET_GPR);
   Reg tmp = ra_scratch(as, rset_exclude(RSET_GPR, tab));
   MCLabel l_end = emit_label(as);
+  MCLabel l_touched, l_full;
+  emit_i8(as, G_TOUCHED1);
+  emit_rmro(as, XO_MOVmib, 0, tab, offsetof(GCtab, age));
+  l_touched = emit_label(as);
+  /* Remembered set is full, use grayagain instead. */
   emit_movtomro(as, tmp|REX_GC64, tab, offsetof(GCtab, gclist));
   emit_setgl(as, tab, gc.grayagain);
   emit_getgl(as, tmp, gc.grayagain);
+  l_full = emit_label(as);
+  emit_sjmp(as, l_touched);
+  emit_setgl(as, tmp, gc.remsettop);
+  emit_gri(as, XG_ARITHi(XOg_ADD), tmp|REX_GC64, (int32_t)sizeof(GCRef));
+  emit_movtomro(as, tab|REX_GC64, tmp, 0);
+  emit_sjcc(as, CC_AE, l_full);
+  emit_opgl(as, XO_ARITH(XOg_CMP), tmp|REX_GC64, gc.remsetlim);
+  emit_getgl(as, tmp, gc.remsettop);
+  emit_sjcc(as, CC_E, l_touched);  /* Already remembered if G_TOUCHED2. */
+  emit_i8(as, G_TOUCHED2);
+  emit_rmro(as, XO_ARITHib, XOg_CMP, tab, offsetof(GCtab, age));
   emit_i8(as, ~LJ_GC_BLACK);
   emit_rmro(as, XO_ARITHib, XOg_AND, tab, offsetof(GCtab, marked));
   emit_sjcc(as, CC_Z, l_end);
@@ -98,6 +98,10 @@ typedef struct GG_State {
 #endif
   ASMFunction dispatch[GG_LEN_DISP];	/* Instruction dispatch tables. */
   BCIns bcff[GG_NUM_ASMFF];		/* Bytecode for ASM fast functions. */
+  GCStats gcstats;			/* GC telemetry. */
+#if LJ_HASPROFILE
+  struct ProfileState *prof;		/* Profiler state or NULL. */
+#endif
 } GG_State;
 
 #define GG_OFS(field)	((int)offsetof(GG_State, field))
@@ -407,7 +407,6 @@ static void emit_loadk64(ASMState *as, Reg r, IRIns *ir)
 /* Label for short jumps. */
 typedef MCode *MCLabel;
 
-#if LJ_32 && LJ_HASFFI
 /* jmp short target */
 static void emit_sjmp(ASMState *as, MCLabel target)
 {
@@ -418,7 +417,6 @@ static void emit_sjmp(ASMState *as, MCLabel target)
   p[-2] = XI_JMPs;
   as->mcp = p - 2;
 }
-#endif
 
 /* jcc short target */
 static void emit_sjcc(ASMState *as, int cc, MCLabel target)
@@ -92,6 +92,7 @@ FFDEF(table_maxn)
 FFDEF(table_insert)
 FFDEF(table_concat)
 FFDEF(table_sort)
+FFDEF(table_freeze)
 FFDEF(table_new)
 FFDEF(table_clear)
 FFDEF(io_method_close)
@@ -157,10 +158,14 @@ FFDEF(jit_util_tracesnap)
 FFDEF(jit_util_tracemc)
 FFDEF(jit_util_traceexitstub)
 FFDEF(jit_util_ircalladdr)
+FFDEF(jit_util_tabinfo)
 FFDEF(jit_opt_start)
 FFDEF(jit_profile_start)
 FFDEF(jit_profile_stop)
 FFDEF(jit_profile_dumpstack)
+FFDEF(jit_profile_folded)
+FFDEF(jit_profile_alloc)
+FFDEF(jit_profile_allocfolded)
 FFDEF(ffi_meta___index)
 FFDEF(ffi_meta___newindex)
 FFDEF(ffi_meta___eq)
@@ -1100,6 +1100,7 @@ static void LJ_FASTCALL recff_table_clear(jit_State *J, RecordFFData *rd)
   TRef tr = J->base[0];
   if (tref_istab(tr)) {
     rd->nres = 0;
+    lj_record_tabwrite(J, tr, tabV(&rd->argv[0]));
     lj_ir_call(J, IRCALL_lj_tab_clear, tr);
     J->needsnap = 1;
   }  /* else: Interpreter will throw. */
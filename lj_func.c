@@ -49,6 +49,8 @@ static GCupval *func_finduv(lua_State *L, TValue *slot)
     pp = &p->nextgc;
   }
   /* No matching upvalue found. Create a new one. */
+  if (g->gc.kind == KGC_GEN && !L->younguv)
+    lj_gc_addyounguv(L);  /* Only these threads are swept by minor GCs. */
   uv = lj_mem_newt(L, sizeof(GCupval), GCupval);
   newwhite(g, uv);
   setage(obj2gco(uv), G_NEW);
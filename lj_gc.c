@@ -26,6 +26,14 @@
 #endif
 #include "lj_trace.h"
 #include "lj_vm.h"
+#include "lj_dispatch.h"
+#include "lj_alloc.h"
+#if LJ_HASGCTHREAD
+#include "lj_gcthread.h"
+#endif
+#if LJ_HASPROFILE
+#include "lj_profile.h"
+#endif
 
 #define GCSTEPSIZE	1024u
 #define GCSWEEPMAX	40
@@ -37,55 +45,114 @@
 #define gray2black(x)		((x)->gch.marked |= LJ_GC_BLACK)
 #define isfinalized(u)		((u)->marked & LJ_GC_FINALIZED)
 
-/* -- Mark phase ---------------------------------------------------------- */
+/* Notify the allocation sampler of freed and promoted objects. */
+#if LJ_HASPROFILE
+#define gc_samplefree(g, o) \
+  { if (LJ_UNLIKELY((g)->gc.allocsample)) lj_profile_allocfree((g), (o)); }
+#define gc_sampleold(g, o) \
+  { if (LJ_UNLIKELY((g)->gc.allocsample)) lj_profile_allocold((g), (o)); }
+#else
+#define gc_samplefree(g, o)	UNUSED(o)
+#define gc_sampleold(g, o)	UNUSED(o)
+#endif
 
-/* Mark a TValue (if needed). */
-#define gc_marktv(g, tv) \
-  { lua_assert(!tvisgcv(tv) || (~itype(tv) == gcval(tv)->gch.gct)); \
-    if (tviswhite(tv)) gc_mark(g, gcV(tv)); }
+/* -- GC telemetry -------------------------------------------------------- */
 
-/* Mark a GCobj (if needed). */
-#define gc_markobj(g, o) \
-  { if (iswhite(obj2gco(o))) gc_mark(g, obj2gco(o)); }
+#if LJ_TARGET_WINDOWS
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <time.h>
+#endif
 
-/* Mark a string object. */
-#define gc_mark_str(s)		((s)->marked &= (uint8_t)~LJ_GC_WHITES)
+#define gcstats(g)	(&G2GG(g)->gcstats)
 
-static GCRef empty;
+/* Phase of each GC state. ORDER GCS */
+static const uint8_t gc_statephase[] = {
+  GCPHASE_propagate, GCPHASE_propagate, GCPHASE_atomic, GCPHASE_sweepstring,
+  GCPHASE_sweep, GCPHASE_finalize
+};
 
-#include <sys/time.h>
-long long tick()
+/* Monotonic clock in ns. */
+static uint64_t gc_clock(void)
 {
-  struct timeval time;
-  gettimeofday(&time, NULL);
-  return time.tv_sec*1000 + time.tv_usec/1000;
+#if LJ_TARGET_WINDOWS
+  LARGE_INTEGER c, f;
+  QueryPerformanceCounter(&c);
+  QueryPerformanceFrequency(&f);
+  return (uint64_t)((double)c.QuadPart * 1e9 / (double)f.QuadPart);
+#elif LJ_TARGET_POSIX
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#else
+  return (uint64_t)clock() * (1000000000u / CLOCKS_PER_SEC);
+#endif
 }
 
-#ifdef _GC_DEBUG2
-static long long last_time;
-#endif
-void enter(long long *time)
+/* Switch to another phase. Charges the time spent in the current one. */
+static void gc_stats_phase(global_State *g, int phase)
 {
-#ifdef _GC_DEBUG2
-  if (time == NULL)
-    last_time = tick();
-  else
-    *time = tick();
-#endif
+  GCStats *st = gcstats(g);
+  if (st->depth && st->phase != phase) {
+    uint64_t now = gc_clock();
+    if (st->phase >= 0) {
+      GCPhaseStats *ps = &st->phases[st->phase];
+      uint64_t ns = now - st->tphase;
+      ps->ns += ns;
+      ps->num++;
+      if (ns > ps->maxns) ps->maxns = ns;
+    }
+    st->phase = phase;
+    st->tphase = now;
+  }
 }
 
-void leave(const char *log, long long *time)
+/* Start a pause. Pauses nest, e.g. for a full GC called from a finalizer. */
+static void gc_stats_begin(global_State *g)
 {
-#ifdef _GC_DEBUG2
-  if (time == NULL) {
-    gc_debug2("%s: %lld\n", log, tick()-last_time);
+  GCStats *st = gcstats(g);
+  if (st->depth++ == 0) {
+    st->phase = -1;
+    gc_stats_phase(g, gc_statephase[g->gc.state]);
+    st->tpause = st->tphase;
   }
-  else {
-    gc_debug2("%s: %lld\n", log, tick()-*time);
+}
+
+/* End a pause and add it to the histogram. */
+static void gc_stats_end(global_State *g)
+{
+  GCStats *st = gcstats(g);
+  if (st->depth == 1) {
+    uint64_t ns;
+    MSize i = 0;
+    gc_stats_phase(g, -1);
+    ns = st->tphase - st->tpause;
+    st->pauses++;
+    st->pausens += ns;
+    if (ns > st->maxpausens) st->maxpausens = ns;
+    while (i < GC_PAUSEHIST-1 && ns >= ((uint64_t)1024 << i)) i++;
+    st->pausehist[i]++;
   }
-#endif
+  st->depth--;
 }
 
+/* -- Mark phase ---------------------------------------------------------- */
+
+/* Mark a TValue (if needed). */
+#define gc_marktv(g, tv) \
+  { lua_assert(!tvisgcv(tv) || (~itype(tv) == gcval(tv)->gch.gct)); \
+    if (tviswhite(tv)) gc_mark(g, gcV(tv)); }
+
+/* Mark a GCobj (if needed). */
+#define gc_markobj(g, o) \
+  { if (iswhite(obj2gco(o))) gc_mark(g, obj2gco(o)); }
+
+/* Mark a string object. */
+#define gc_mark_str(s)		((s)->marked &= (uint8_t)~LJ_GC_WHITES)
+
+static GCRef empty;
+
 /* Mark a white GCobj. */
 static void gc_mark(global_State *g, GCobj *o)
 {
@@ -129,6 +196,7 @@ static void gc_mark_start(global_State *g)
   setgcrefnull(g->gc.gray);
   setgcrefnull(g->gc.grayagain);
   setgcrefnull(g->gc.weak);
+  setmref(g->gc.remsettop, mref(g->gc.remset, GCRef));
   gc_markobj(g, mainthread(g));
   gc_markobj(g, tabref(mainthread(g)->env));
   gc_marktv(g, &g->registrytv);
@@ -253,12 +321,6 @@ static int gc_traverse_tab(global_State *g, GCtab *t)
       }
     }
   }
-  if (!weak && g->gc.kind == KGC_GEN) {
-    gc_debug("gc_traverse_tab: add to grayagain: %p\n", t);
-    setgcrefr(t->gclist, g->gc.grayagain);
-    setgcref(g->gc.grayagain, obj2gco(t));
-    black2gray(obj2gco(t));
-  }
   return weak;
 }
 
@@ -379,8 +441,15 @@ static size_t propagatemark(global_State *g)
   setgcrefr(g->gc.gray, o->gch.gclist);  /* Remove from gray list. */
   if (LJ_LIKELY(gct == ~LJ_TTAB)) {
     GCtab *t = gco2tab(o);
-    if (gc_traverse_tab(g, t) > 0)
+    if (gc_traverse_tab(g, t) > 0) {
       black2gray(o);  /* Keep weak tables gray. */
+    } else if (getage(o) == G_TOUCHED1 && g->gc.kind == KGC_GEN) {
+      /* Touched table from grayagain: keep it for correctgraylists. */
+      gc_debug("propagatemark: add to grayagain: %p\n", t);
+      setgcrefr(t->gclist, g->gc.grayagain);
+      setgcref(g->gc.grayagain, o);
+      black2gray(o);
+    }
     return sizeof(GCtab) + sizeof(TValue) * t->asize +
 			   (t->hmask ? sizeof(Node) * (t->hmask + 1) : 0);
   } else if (LJ_LIKELY(gct == ~LJ_TFUNC)) {
@@ -421,6 +490,418 @@ static size_t gc_propagate_gray(global_State *g)
   return m;
 }
 
+#if LJ_HASGCTHREAD
+/* -- Parallel mark phase ------------------------------------------------- */
+
+/*
+** Full collections can propagate the marks with several threads. Each
+** marker owns a small stack of gray tables, functions and prototypes,
+** which the other markers steal from when they run out of work. Stack
+** overflows are spilled to a shared list, linked through gclist. A white
+** object is claimed with a CAS on its marked byte, so only the winning
+** marker traverses it. Threads, traces and weak tables are handed back
+** to the VM thread, which traverses them with propagatemark.
+*/
+
+#define GCMARKSTACK	256	/* Size of the stack of each marker. */
+
+typedef struct GCMarker {
+  uint32_t lock;		/* Protects the stack against thieves. */
+  MSize top;			/* Number of objects on the stack. */
+  size_t size;			/* Size of the traversed objects. */
+  GCobj *stack[GCMARKSTACK];	/* Gray objects. */
+} GCMarker;
+
+typedef struct GCMarkState {
+  global_State *g;		/* Global state. */
+  GCThreadPool *pool;		/* Helper threads, see lj_gc_setmarkers. */
+  int32_t active;		/* Number of markers holding work. */
+  uint32_t spilllock;		/* Protects spill and nspill. */
+  uint32_t deferlock;		/* Protects defer. */
+  MSize nspill;			/* Number of objects in spill. */
+  GCRef spill;			/* Gray objects not on a stack. */
+  GCRef defer;			/* Gray objects for the VM thread. */
+  GCMarker w[LJ_GC_MAXMARKERS+1];  /* Markers. w[0] is the VM thread. */
+} GCMarkState;
+
+#define gc_par_get(p)		__atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define gc_par_set(p, v)	__atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#define gc_par_add(p, v)	__atomic_add_fetch((p), (v), __ATOMIC_SEQ_CST)
+#define gc_par_iswhite(o) \
+  (__atomic_load_n(&(o)->gch.marked, __ATOMIC_RELAXED) & LJ_GC_WHITES)
+#define gc_par_gray2black(o) \
+  __atomic_fetch_or(&(o)->gch.marked, LJ_GC_BLACK, __ATOMIC_RELAXED)
+
+#define gc_par_marktv(ms, w, tv) \
+  { if (tvisgcv(tv) && gc_par_iswhite(gcV(tv))) gc_par_mark(ms, w, gcV(tv)); }
+#define gc_par_markobj(ms, w, o) \
+  { if (gc_par_iswhite(obj2gco(o))) gc_par_mark(ms, w, obj2gco(o)); }
+
+static void gc_par_lock(uint32_t *lock)
+{
+  while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE))
+    lj_gcthread_yield();
+}
+
+static void gc_par_unlock(uint32_t *lock)
+{
+  __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+/* Turn a white object gray. Returns 0 if another marker was faster. */
+static int gc_par_claim(GCobj *o)
+{
+  uint8_t m = __atomic_load_n(&o->gch.marked, __ATOMIC_RELAXED);
+  while ((m & LJ_GC_WHITES))
+    if (__atomic_compare_exchange_n(&o->gch.marked, &m,
+				    (uint8_t)(m & ~LJ_GC_WHITES), 1,
+				    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+      return 1;
+  return 0;
+}
+
+/* Link a list of gray objects into the spill list. */
+static void gc_par_spill(GCMarkState *ms, GCobj **list, MSize n)
+{
+  MSize i;
+  gc_par_lock(&ms->spilllock);
+  for (i = 0; i < n; i++) {
+    setgcrefr(list[i]->gch.gclist, ms->spill);
+    setgcref(ms->spill, list[i]);
+  }
+  gc_par_set(&ms->nspill, ms->nspill + n);
+  gc_par_unlock(&ms->spilllock);
+}
+
+/* Push a gray object onto the stack of a marker. */
+static void gc_par_push(GCMarkState *ms, GCMarker *w, GCobj *o)
+{
+  gc_par_lock(&w->lock);
+  if (LJ_UNLIKELY(w->top == GCMARKSTACK)) {  /* Spill the older half. */
+    GCobj *tmp[GCMARKSTACK/2];
+    memcpy(tmp, w->stack, sizeof(tmp));
+    memmove(w->stack, w->stack + GCMARKSTACK/2, sizeof(tmp));
+    gc_par_set(&w->top, GCMARKSTACK/2);
+    gc_par_unlock(&w->lock);
+    gc_par_spill(ms, tmp, GCMARKSTACK/2);
+    gc_par_lock(&w->lock);
+  }
+  w->stack[w->top] = o;
+  gc_par_set(&w->top, w->top+1);
+  gc_par_unlock(&w->lock);
+}
+
+/* Pop a gray object from the stack of a marker. */
+static GCobj *gc_par_pop(GCMarker *w)
+{
+  GCobj *o = NULL;
+  gc_par_lock(&w->lock);
+  if (w->top) {
+    o = w->stack[w->top-1];
+    gc_par_set(&w->top, w->top-1);
+  }
+  gc_par_unlock(&w->lock);
+  return o;
+}
+
+/* Hand a gray object to the VM thread. */
+static void gc_par_defer(GCMarkState *ms, GCobj *o)
+{
+  gc_par_lock(&ms->deferlock);
+  setgcrefr(o->gch.gclist, ms->defer);
+  setgcref(ms->defer, o);
+  gc_par_unlock(&ms->deferlock);
+}
+
+/* Mark a white GCobj. Parallel variant of gc_mark. */
+static void gc_par_mark(GCMarkState *ms, GCMarker *w, GCobj *o)
+{
+  int gct = o->gch.gct;
+  if (!gc_par_claim(o))
+    return;
+  if (LJ_UNLIKELY(gct == ~LJ_TUDATA)) {
+    GCtab *mt = tabref(gco2ud(o)->metatable);
+    gc_par_gray2black(o);  /* Userdata are never gray. */
+    if (mt) gc_par_markobj(ms, w, mt);
+    gc_par_markobj(ms, w, tabref(gco2ud(o)->env));
+  } else if (LJ_UNLIKELY(gct == ~LJ_TUPVAL)) {
+    GCupval *uv = gco2uv(o);
+    gc_par_marktv(ms, w, uvval(uv));
+    if (uv->closed)
+      gc_par_gray2black(o);  /* Closed upvalues are never gray. */
+  } else if (gct == ~LJ_TTAB || gct == ~LJ_TFUNC || gct == ~LJ_TPROTO) {
+    gc_par_push(ms, w, o);
+  } else if (gct == ~LJ_TTHREAD || gct == ~LJ_TTRACE) {
+    gc_par_defer(ms, o);
+  }
+}
+
+/* Check for a valid __mode field without touching the metamethod cache. */
+static int gc_par_isweak(global_State *g, GCtab *mt)
+{
+  cTValue *mode;
+  if ((mt->nomm & (1u<<MM_mode)))
+    return 0;
+  mode = lj_tab_getstr(mt, mmname_str(g, MM_mode));
+  if (mode && tvisstr(mode)) {
+    const char *modestr = strVdata(mode);
+    int c;
+    while ((c = *modestr++))
+      if (c == 'k' || c == 'v') return 1;
+  }
+  return 0;
+}
+
+/* Traverse a gray object and turn it black. Parallel propagatemark. */
+static size_t gc_par_propagate(GCMarkState *ms, GCMarker *w, GCobj *o)
+{
+  int gct = o->gch.gct;
+  if (LJ_LIKELY(gct == ~LJ_TTAB)) {
+    GCtab *t = gco2tab(o);
+    GCtab *mt = tabref(t->metatable);
+    MSize i;
+    if (mt) {
+      gc_par_markobj(ms, w, mt);
+      if (gc_par_isweak(ms->g, mt)) {  /* Weak tables need the VM thread. */
+	gc_par_defer(ms, o);
+	return 0;
+      }
+    }
+    gc_par_gray2black(o);
+    for (i = 0; i < t->asize; i++)
+      gc_par_marktv(ms, w, arrayslot(t, i));
+    if (t->hmask > 0) {
+      Node *node = noderef(t->node);
+      for (i = 0; i <= t->hmask; i++) {
+	Node *n = &node[i];
+	if (!tvisnil(&n->val)) {
+	  gc_par_marktv(ms, w, &n->key);
+	  gc_par_marktv(ms, w, &n->val);
+	}
+      }
+    }
+    return sizeof(GCtab) + sizeof(TValue) * t->asize +
+			   (t->hmask ? sizeof(Node) * (t->hmask + 1) : 0);
+  } else if (LJ_LIKELY(gct == ~LJ_TFUNC)) {
+    GCfunc *fn = gco2func(o);
+    uint32_t i;
+    gc_par_gray2black(o);
+    gc_par_markobj(ms, w, tabref(fn->c.env));
+    if (isluafunc(fn)) {
+      gc_par_markobj(ms, w, funcproto(fn));
+      for (i = 0; i < fn->l.nupvalues; i++)
+	gc_par_markobj(ms, w, &gcref(fn->l.uvptr[i])->uv);
+      return sizeLfunc((MSize)fn->l.nupvalues);
+    } else {
+      for (i = 0; i < fn->c.nupvalues; i++)
+	gc_par_marktv(ms, w, &fn->c.upvalue[i]);
+      return sizeCfunc((MSize)fn->c.nupvalues);
+    }
+  } else {
+    GCproto *pt = gco2pt(o);
+    ptrdiff_t i;
+    lua_assert(gct == ~LJ_TPROTO);
+    gc_par_gray2black(o);
+    gc_par_markobj(ms, w, proto_chunkname(pt));
+    for (i = -(ptrdiff_t)pt->sizekgc; i < 0; i++)
+      gc_par_markobj(ms, w, proto_kgc(pt, i));
+#if LJ_HASJIT
+    if (pt->trace)
+      gc_par_markobj(ms, w, traceref(G2J(ms->g), pt->trace));
+#endif
+    return pt->sizept;
+  }
+}
+
+/* Check for work on any stack or in the spill list. */
+static int gc_par_haswork(GCMarkState *ms)
+{
+  MSize i;
+  if (gc_par_get(&ms->nspill))
+    return 1;
+  for (i = 0; i <= LJ_GC_MAXMARKERS; i++)
+    if (gc_par_get(&ms->w[i].top))
+      return 1;
+  return 0;
+}
+
+/* Fill the empty stack of a marker from the spill list or by stealing. */
+static int gc_par_grab(GCMarkState *ms, GCMarker *w, int id)
+{
+  GCobj *tmp[GCMARKSTACK/2];
+  MSize i, n = 0;
+  if (gc_par_get(&w->top))
+    return 1;
+  if (gc_par_get(&ms->nspill)) {
+    gc_par_lock(&ms->spilllock);
+    for (; n < GCMARKSTACK/2 && gcref(ms->spill); n++) {
+      tmp[n] = gcref(ms->spill);
+      setgcrefr(ms->spill, tmp[n]->gch.gclist);
+    }
+    gc_par_set(&ms->nspill, ms->nspill - n);
+    gc_par_unlock(&ms->spilllock);
+  }
+  for (i = 1; n == 0 && i <= LJ_GC_MAXMARKERS; i++) {  /* Steal. */
+    GCMarker *v = &ms->w[(id + i) % (LJ_GC_MAXMARKERS+1)];
+    if (gc_par_get(&v->top)) {
+      gc_par_lock(&v->lock);
+      n = (v->top + 1) / 2;  /* Take the older half. */
+      memcpy(tmp, v->stack, n * sizeof(GCobj *));
+      memmove(v->stack, v->stack + n, (v->top - n) * sizeof(GCobj *));
+      gc_par_set(&v->top, v->top - n);
+      gc_par_unlock(&v->lock);
+    }
+  }
+  if (n == 0)
+    return 0;
+  gc_par_lock(&w->lock);
+  memcpy(w->stack + w->top, tmp, n * sizeof(GCobj *));
+  gc_par_set(&w->top, w->top + n);
+  gc_par_unlock(&w->lock);
+  return 1;
+}
+
+/* Marker main loop. Returns when no marker holds any work. */
+static void gc_par_run(void *ud, int id)
+{
+  GCMarkState *ms = (GCMarkState *)ud;
+  GCMarker *w = &ms->w[id];
+  for (;;) {
+    if (gc_par_haswork(ms)) {
+      gc_par_add(&ms->active, 1);
+      if (gc_par_grab(ms, w, id)) {
+	GCobj *o;
+	while ((o = gc_par_pop(w)) != NULL)
+	  w->size += gc_par_propagate(ms, w, o);
+      }
+      gc_par_add(&ms->active, -1);
+    } else if (gc_par_get(&ms->active) == 0 && !gc_par_haswork(ms)) {
+      break;
+    } else {
+      lj_gcthread_yield();
+    }
+  }
+}
+
+/* Propagate all gray objects with the VM thread and g->gc.nmarkers helpers. */
+static size_t gc_propagate_par(global_State *g)
+{
+  GCMarkState *ms = mref(g->gc.markstate, GCMarkState);
+  size_t m = 0;
+  while (gcref(g->gc.gray) != NULL) {
+    GCobj *o;
+    MSize i;
+    ms->active = 0;
+    ms->nspill = 0;
+    for (o = gcref(g->gc.gray); o; o = gcref(o->gch.gclist))
+      ms->nspill++;
+    setgcrefr(ms->spill, g->gc.gray);
+    setgcrefnull(ms->defer);
+    setgcrefnull(g->gc.gray);
+    for (i = 0; i <= LJ_GC_MAXMARKERS; i++) {
+      ms->w[i].lock = 0;
+      ms->w[i].top = 0;
+      ms->w[i].size = 0;
+    }
+    lj_gcthread_run(ms->pool, gc_par_run, ms);
+    for (i = 0; i <= LJ_GC_MAXMARKERS; i++)
+      m += ms->w[i].size;
+    /* Traverse the deferred objects. They may make more objects gray. */
+    o = gcref(ms->defer);
+    while (o != NULL) {
+      GCobj *next = gcref(o->gch.gclist);
+      setgcrefr(o->gch.gclist, g->gc.gray);
+      setgcref(g->gc.gray, o);
+      m += propagatemark(g);
+      o = next;
+    }
+  }
+  return m;
+}
+#endif
+
+/* Propagate all gray objects. Full collections may use the helper threads. */
+static size_t gc_propagate_all(global_State *g)
+{
+#if LJ_HASGCTHREAD
+  if (g->gc.fullmark && g->gc.nmarkers && g->gc.kind != KGC_GEN)
+    return gc_propagate_par(g);
+#endif
+  return gc_propagate_gray(g);
+}
+
+/*
+** Traverse only the dirty cards of a black G_TOUCHED2 table. Returns 0
+** if the table has no card table or may be weak and needs a full pass.
+*/
+static int gc_traverse_cards(global_State *g, GCtab *t)
+{
+  GCtab *mt = tabref(t->metatable);
+  cTValue *mode = lj_meta_fastg(g, mt, MM_mode);
+  uint8_t *card = tabcard(t, 0);
+  MSize i, asize = t->asize;
+  if (!sizetabcards(asize) || g->gc.kind != KGC_GEN ||
+      (mode && tvisstr(mode)))
+    return 0;
+  if (*tabhcard(t)) {  /* Mark metatable and hash part. */
+    Node *node = noderef(t->node);
+    MSize hmask = t->hmask;
+    if (mt)
+      gc_markobj(g, mt);
+    for (i = 0; hmask && i <= hmask; i++) {
+      Node *n = &node[i];
+      if (!tvisnil(&n->val)) {
+	gc_marktv(g, &n->key);
+	gc_marktv(g, &n->val);
+      }
+    }
+  }
+  for (i = 0; i < asize; card--) {  /* Mark the array slots of dirty cards. */
+    MSize e = i + (1u << LJ_GC_CARDSHIFT);
+    if (e > asize) e = asize;
+    if (*card) {
+      for (; i < e; i++)
+	gc_marktv(g, arrayslot(t, i));
+    }
+    i = e;
+  }
+  return 1;
+}
+
+/*
+** Traverse the tables in the remembered set. Unlike grayagain this is a
+** sequential scan, without chasing gclist pointers. G_TOUCHED2 tables
+** are traversed once more, too: values stored in the previous cycle are
+** only survivals now. In generational mode the set is kept for
+** correctremset, except for weak tables which now sit on the weak list.
+** A black table was only written through its cards, see lj_gc.h. After
+** a full traversal all cards are set dirty to get the same aging.
+*/
+static void gc_traverse_remset(global_State *g)
+{
+  GCRef *rs = mref(g->gc.remset, GCRef);
+  GCRef *top = mref(g->gc.remsettop, GCRef);
+  GCRef *p, *q = rs;
+  for (p = rs; p < top; p++) {
+    GCobj *o = gcref(*p);
+    GCtab *t = gco2tab(o);
+    if (isblack(o) && gc_traverse_cards(g, t)) {
+      *q++ = *p;
+      continue;
+    }
+    gray2black(o);
+    if (gc_traverse_tab(g, t) > 0) {
+      black2gray(o);  /* Keep weak tables gray. */
+      if (gcref(g->gc.weak) == o)
+	continue;
+    } else if (g->gc.kind == KGC_GEN && sizetabcards(t->asize)) {
+      memset(tabcards(t), LJ_GC_CARDDIRTY, sizetabcards(t->asize));
+    }
+    *q++ = *p;
+  }
+  setmref(g->gc.remsettop, g->gc.kind == KGC_GEN ? q : rs);
+}
+
 /* -- Sweep phase --------------------------------------------------------- */
 
 /* Type of GC free functions. */
@@ -462,12 +943,14 @@ static GCRef *gc_sweep(global_State *g, GCRef *p, uint32_t lim)
     if (((o->gch.marked ^ LJ_GC_WHITES) & ow)) {  /* Black or current white? */
       lua_assert(!isdead(g, o) || (o->gch.marked & LJ_GC_FIXED));
       makewhite(g, o);  /* Value is alive, change to the current white. */
+      setage(o, G_NEW);  /* Forget generational ages (e.g. G_TOUCHED2). */
       p = &o->gch.nextgc;
     } else {  /* Otherwise value is dead, free it. */
       lua_assert(isdead(g, o) || ow == LJ_GC_SFIXED);
       setgcrefr(*p, o->gch.nextgc);
       if (o == gcref(g->gc.root))
 	setgcrefr(g->gc.root, o->gch.nextgc);  /* Adjust list anchor. */
+      gc_samplefree(g, o);
       gc_freefunc[o->gch.gct - ~LJ_TSTR](g, o);
     }
   }
@@ -540,8 +1023,10 @@ static void gc_call_finalizer(global_State *g, lua_State *L,
   errcode = lj_vm_pcall(L, top, 1+0, -1);  /* Stack: |mo|o| -> | */
   hook_restore(g, oldh);
   g->gc.threshold = oldt;  /* Restore GC threshold. */
-  if (errcode)
+  if (errcode) {
+    gcstats(g)->depth = 0;  /* The pauses in progress are not recorded. */
     lj_err_throw(L, errcode);  /* Propagate errors. */
+  }
 }
 
 /* Finalize one userdata or cdata object from the mmudata list. */
@@ -632,6 +1117,9 @@ void lj_gc_freeall(global_State *g)
 
 /* -- Collector ----------------------------------------------------------- */
 
+static void atomic2gen(lua_State *L, global_State *g);
+static void genstable(global_State *g);
+
 /* Atomic part of the GC cycle, transitioning from mark to sweep phase. */
 static void atomic(global_State *g, lua_State *L)
 {
@@ -643,12 +1131,13 @@ static void atomic(global_State *g, lua_State *L)
   setgcrefnull(g->gc.grayagain);
 
   g->gc.state = GCSatomic;
+  gc_stats_phase(g, GCPHASE_atomic);
 
   gc_debug("atomic: print grayagain\n");
 
   gc_debug("atomic: propagate uv\n");
   gc_mark_uv(g);  /* Need to remark open upvalues (the thread may be dead). */
-  gc_propagate_gray(g);  /* Propagate any left-overs. */
+  gc_propagate_all(g);  /* Propagate any left-overs. */
 
   gc_debug("atomic: propagate weak, mainthread, gcroot\n");
   setgcrefr(g->gc.gray, g->gc.weak);  /* Empty the list of weak tables. */
@@ -657,16 +1146,18 @@ static void atomic(global_State *g, lua_State *L)
   gc_markobj(g, L);  /* Mark running thread. */
   gc_traverse_curtrace(g);  /* Traverse current trace. */
   gc_mark_gcroot(g);  /* Mark GC roots (again). */
-  gc_propagate_gray(g);  /* Propagate all of the above. */
+  gc_propagate_all(g);  /* Propagate all of the above. */
 
   gc_debug("atomic: propagate weak, grayagain\n");
   setgcrefr(g->gc.gray, grayagain);
-  gc_propagate_gray(g);  /* Propagate it. */
+  gc_propagate_all(g);  /* Propagate it. */
+  gc_traverse_remset(g);  /* Traverse touched tables. */
+  gc_propagate_all(g);  /* And propagate the marks. */
 
   gc_debug("atomic: propagate udata\n");
   udsize = lj_gc_separateudata(g, 0);  /* Separate userdata to be finalized. */
   gc_mark_mmudata(g);  /* Mark them. */
-  udsize += gc_propagate_gray(g);  /* And propagate the marks. */
+  udsize += gc_propagate_all(g);  /* And propagate the marks. */
 
   /* All marking done, clear weak tables. */
   gc_clearweak(gcref(g->gc.weak));
@@ -681,7 +1172,7 @@ static void atomic(global_State *g, lua_State *L)
 }
 
 /* GC state machine. Returns a cost estimate for each step performed. */
-static size_t gc_onestep(lua_State *L)
+static size_t gc_statestep(lua_State *L)
 {
   global_State *g = G(L);
   switch (g->gc.state) {
@@ -697,6 +1188,11 @@ static size_t gc_onestep(lua_State *L)
     if (tvref(g->jit_base))  /* Don't run atomic phase on trace. */
       return LJ_MAX_MEM;
     atomic(g, L);
+    gcstats(g)->major++;
+    if (g->gc.kind == KGC_GENMAJOR && !g->gc.genbad) {  /* Major cycle done. */
+      atomic2gen(L, g);
+      return 0;
+    }
     g->gc.state = GCSsweepstring;  /* Start of sweep phase. */
     g->gc.sweepstr = 0;
     return 0;
@@ -707,6 +1203,7 @@ static size_t gc_onestep(lua_State *L)
       g->gc.state = GCSsweep;  /* All string hash chains sweeped. */
     lua_assert(old >= g->gc.total);
     g->gc.estimate -= old - g->gc.total;
+    gcstats(g)->freedold += old - g->gc.total;
     return GCSWEEPCOST;
     }
   case GCSsweep: {
@@ -714,6 +1211,7 @@ static size_t gc_onestep(lua_State *L)
     setmref(g->gc.sweep, gc_sweep(g, mref(g->gc.sweep, GCRef), GCSWEEPMAX));
     lua_assert(old >= g->gc.total);
     g->gc.estimate -= old - g->gc.total;
+    gcstats(g)->freedold += old - g->gc.total;
     if (gcref(*mref(g->gc.sweep, GCRef)) == NULL) {
       if (g->strnum <= (g->strmask >> 2) && g->strmask > LJ_MIN_STRTAB*2-1)
 	lj_str_resize(L, g->strmask >> 1);  /* Shrink string table. */
@@ -750,34 +1248,43 @@ static size_t gc_onestep(lua_State *L)
   }
 }
 
+/* Do one GC step and keep the phase clock in sync with the state. */
+static size_t gc_onestep(lua_State *L)
+{
+  global_State *g = G(L);
+  size_t m = gc_statestep(L);
+  gc_stats_phase(g, gc_statephase[g->gc.state]);
+  return m;
+}
+
 /* Perform a limited amount of incremental GC steps. */
 static int incstep(lua_State *L)
 {
   global_State *g = G(L);
   GCSize lim;
-  int32_t ostate = g->vmstate;
-  setvmstate(g, GC);
-  lim = (GCSTEPSIZE/100) * g->gc.stepmul;
+  lim = (GCSTEPSIZE/100) * ((g->gc.kind == KGC_GENMAJOR && !g->gc.genbad) ?
+			    g->gc.genstepmul : g->gc.stepmul);
   if (lim == 0)
     lim = LJ_MAX_MEM;
   if (g->gc.total > g->gc.threshold)
     g->gc.debt += g->gc.total - g->gc.threshold;
   do {
     lim -= (GCSize)gc_onestep(L);
-    if (g->gc.state == GCSpause) {
+    if (g->gc.kind == KGC_GEN)  /* atomic2gen set up the next threshold. */
+      return 1;  /* Finished a major generational cycle. */
+    if (g->gc.state == GCSpause && (g->gc.kind == KGC_INC || g->gc.genbad)) {
+      if (g->gc.genbad)
+	genstable(g);
       g->gc.threshold = (g->gc.estimate/100) * g->gc.pause;
-      g->vmstate = ostate;
       return 1;  /* Finished a GC cycle. */
     }
   } while (sizeof(lim) == 8 ? ((int64_t)lim > 0) : ((int32_t)lim > 0));
   if (g->gc.debt < GCSTEPSIZE) {
     g->gc.threshold = g->gc.total + GCSTEPSIZE;
-    g->vmstate = ostate;
     return -1;
   } else {
     g->gc.debt -= GCSTEPSIZE;
     g->gc.threshold = g->gc.total;
-    g->vmstate = ostate;
     return 0;
   }
 }
@@ -794,6 +1301,13 @@ void LJ_FASTCALL lj_gc_step_fixtop(lua_State *L)
 int LJ_FASTCALL lj_gc_step_jit(global_State *g, MSize steps)
 {
   lua_State *L = gco2th(gcref(g->cur_L));
+  /*
+  ** Young and full generational collections are not incremental, so
+  ** they cannot run on trace. Force a trace exit instead, lj_trace_exit
+  ** drives the collection from the restored interpreter state.
+  */
+  if (g->gc.kind == KGC_GEN)
+    return 1;
   L->base = tvref(G(L)->jit_base);
   L->top = curr_topL(L);
   while (steps-- > 0 && lj_gc_step(L) == 0)
@@ -828,10 +1342,13 @@ static void sweep2old(lua_State *L, GCRef *p) {
       setgcrefr(*p, o->gch.nextgc);
       gc_debug("sweep2old: free: %p\n", o);
       gc_debug5("sweep2old: free: %p\n", o);
+      gc_samplefree(g, o);
       gc_freefunc[o->gch.gct - ~LJ_TSTR](g, o);
     }
     else {
       gc_debug("sweep2old: age to old: %p\n", o);
+      if (getage(o) != G_OLD)
+        gc_sampleold(g, o);
       setage(o, G_OLD);
       p = &o->gch.nextgc;
     }
@@ -846,12 +1363,53 @@ static void sweepstringsold(lua_State *L) {
   }
 }
 
+/*
+** Grow one of the generational index vectors without throwing. A sweep
+** cannot be unwound halfway, so an allocation failure only sets
+** gc.genlost and finishgencycle redoes the cycle as a major collection.
+** Returns NULL on failure, with the old vector left intact.
+*/
+static GCRef *gc_growindex(global_State *g, GCRef *v, MSize *szp)
+{
+  MSize osz = *szp, sz = osz << 1;
+  if (sz < LJ_MIN_VECSZ)
+    sz = LJ_MIN_VECSZ;
+  if (sz > LJ_MAX_MEM32/sizeof(GCRef) || sz <= osz ||
+      !(v = (GCRef *)g->allocf(g->allocd, v, osz*sizeof(GCRef),
+			       sz*sizeof(GCRef)))) {
+    g->gc.genlost = 1;
+    return NULL;
+  }
+  g->gc.total = (g->gc.total - osz*sizeof(GCRef)) + sz*sizeof(GCRef);
+  *szp = sz;
+  return v;
+}
+
+/* Record an object that just turned 'old1', see markold. */
+static void addold1(global_State *g, GCobj *o) {
+  if (LJ_UNLIKELY(g->gc.old1num >= g->gc.sizeold1)) {
+    GCRef *v = gc_growindex(g, mref(g->gc.old1, GCRef), &g->gc.sizeold1);
+    if (v == NULL) return;
+    setmref(g->gc.old1, v);
+  }
+  setgcref(mref(g->gc.old1, GCRef)[g->gc.old1num++], o);
+}
+
+/* Free the 'old1' index, e.g. when leaving generational mode. */
+static void clearold1(global_State *g) {
+  lj_mem_freevec(g, mref(g->gc.old1, GCRef), g->gc.sizeold1, GCRef);
+  setmref(g->gc.old1, NULL);
+  g->gc.old1num = g->gc.sizeold1 = 0;
+}
+
 /*
 ** Sweep for generational mode. Delete dead objects. (Because the
 ** collection is not incremental, there are no "new white" objects
 ** during the sweep. So, any white object must be dead.) For
 ** non-dead objects, advance their ages and clear the color of
-** new objects. (Old objects keep their colors.)
+** new objects. (Old objects keep their colors.) Objects turning 'old1'
+** are recorded for the next markold. Open upvalues are not swept here,
+** see sweepyounguv.
 */
 static GCRef *sweepgen(lua_State *L, global_State *g, GCRef *p, GCRef limit, GCRef *root) {
 
@@ -869,11 +1427,6 @@ static GCRef *sweepgen(lua_State *L, global_State *g, GCRef *p, GCRef limit, GCR
   GCobj *objlimit = gcref(limit);
   while ((o = gcref(*p)) != objlimit) {
     gc_debug("sweepgen: %p, %d, %d\n", o, o->gch.gct, getage(o));
-
-    // 线程upvalue是否需要特殊处理
-    if (o->gch.gct == ~LJ_TTHREAD)
-      sweepgen(L, g, &gco2th(o)->openupval, empty, NULL);
-
     if (iswhite(o) && !isfixed(o)) {
       lua_assert(!isold(o) && isdead(g, o));
       setgcrefr(*p, o->gch.nextgc);
@@ -881,25 +1434,187 @@ static GCRef *sweepgen(lua_State *L, global_State *g, GCRef *p, GCRef limit, GCR
         setgcrefr(*root, o->gch.nextgc);
       gc_debug("sweepgen: free: %p\n", o);
       gc_debug5("sweepgen: free: %p\n", o);
+      gc_samplefree(g, o);
       gc_freefunc[o->gch.gct - ~LJ_TSTR](g, o);
     }
     else {
       gc_debug("sweepgen: change age: %p, %d\n", o, nextage[getage(o)]);
       if (getage(o) == G_NEW)
         makewhite(g, o);
+      else if (getage(o) == G_OLD1)  /* Turns G_OLD. */
+        gc_sampleold(g, o);
       setage(o, nextage[getage(o)]);
+      if (getage(o) == G_OLD1)
+        addold1(g, o);
       p = &o->gch.nextgc;
     }
   }
   return p;
 }
 
-static void sweepstringsgen(lua_State *L) {
+/*
+** Sweep the strings created since they were last seen by a young
+** collection. Strings have no references, so survivors go straight from
+** G_SURVIVAL to G_OLD and are dropped from the list. This keeps minor
+** collections independent of the size of the string table.
+*/
+static void sweepyoungstr(global_State *g) {
+  GCRef *ys = mref(g->gc.youngstr, GCRef);
+  MSize i, j = 0, n = g->gc.youngstrnum;
+  for (i = 0; i < n; i++) {
+    GCobj *o = gcref(ys[i]);
+    if (iswhite(o) && !isfixed(o)) {  /* Dead: unlink from its hash chain. */
+      GCRef *p = &g->strhash[gco2str(o)->hash & g->strmask];
+      lua_assert(!isold(o) && isdead(g, o));
+      while (gcref(*p) != o)
+        p = &gcref(*p)->gch.nextgc;
+      setgcrefr(*p, o->gch.nextgc);
+      lj_str_free(g, gco2str(o));
+    } else if (getage(o) == G_NEW) {
+      makewhite(g, o);
+      setage(o, G_SURVIVAL);
+      ys[j++] = ys[i];
+    } else {
+      setage(o, G_OLD);
+    }
+  }
+  g->gc.youngstrnum = j;
+}
+
+/* Register a new string for the next young collection. */
+void lj_gc_addyoungstr(lua_State *L, GCstr *s) {
   global_State *g = G(L);
-  int i = 0;
-  for (; i <= g->strmask; ++i) {
-    sweepgen(L, g, &g->strhash[i], empty, NULL);
+  if (LJ_UNLIKELY(g->gc.youngstrnum >= g->gc.sizeyoungstr)) {
+    GCRef *ys = mref(g->gc.youngstr, GCRef);
+    lj_mem_growvec(L, ys, g->gc.sizeyoungstr, LJ_MAX_MEM32/sizeof(GCRef), GCRef);
+    setmref(g->gc.youngstr, ys);
+  }
+  setgcref(mref(g->gc.youngstr, GCRef)[g->gc.youngstrnum++], obj2gco(s));
+}
+
+/* Forget all young strings, e.g. when leaving generational mode. */
+static void clearyoungstr(global_State *g) {
+  lj_mem_freevec(g, mref(g->gc.youngstr, GCRef), g->gc.sizeyoungstr, GCRef);
+  setmref(g->gc.youngstr, NULL);
+  g->gc.youngstrnum = g->gc.sizeyoungstr = 0;
+}
+
+/*
+** Add a thread to gc.uvthreads before it gets a new open upvalue. This
+** may throw, so it must run before the upvalue is linked anywhere.
+*/
+void lj_gc_addyounguv(lua_State *L) {
+  global_State *g = G(L);
+  if (LJ_UNLIKELY(g->gc.uvthreadnum >= g->gc.sizeuvthreads)) {
+    GCRef *ut = mref(g->gc.uvthreads, GCRef);
+    lj_mem_growvec(L, ut, g->gc.sizeuvthreads, LJ_MAX_MEM32/sizeof(GCRef), GCRef);
+    setmref(g->gc.uvthreads, ut);
   }
+  setgcref(mref(g->gc.uvthreads, GCRef)[g->gc.uvthreadnum++], obj2gco(L));
+  L->younguv = 1;
+}
+
+/*
+** Sweep the open upvalues of the threads in gc.uvthreads. A thread is
+** dropped once all of its open upvalues are old, so the open upvalues of
+** long-lived coroutines are not rescanned by every minor collection.
+** This must run before the main sweep, which may free dead threads.
+*/
+static void sweepyounguv(lua_State *L, global_State *g) {
+  GCRef *ut = mref(g->gc.uvthreads, GCRef);
+  MSize i, j = 0, n = g->gc.uvthreadnum;
+  for (i = 0; i < n; i++) {
+    lua_State *th = gco2th(gcref(ut[i]));
+    GCobj *uv;
+    sweepgen(L, g, &th->openupval, empty, NULL);
+    if (iswhite(obj2gco(th)) && !isfixed(obj2gco(th)))
+      continue;  /* Dead thread, freed by the main sweep. */
+    for (uv = gcref(th->openupval); uv != NULL; uv = gcref(uv->gch.nextgc))
+      if (getage(uv) != G_OLD)
+	break;
+    if (uv)
+      ut[j++] = ut[i];
+    else
+      th->younguv = 0;
+  }
+  g->gc.uvthreadnum = j;
+}
+
+/* Empty gc.uvthreads, e.g. when leaving generational mode. */
+static void clearyounguv(global_State *g) {
+  GCRef *ut = mref(g->gc.uvthreads, GCRef);
+  MSize i;
+  for (i = 0; i < g->gc.uvthreadnum; i++)
+    gco2th(gcref(ut[i]))->younguv = 0;
+  lj_mem_freevec(g, ut, g->gc.sizeuvthreads, GCRef);
+  setmref(g->gc.uvthreads, NULL);
+  g->gc.uvthreadnum = g->gc.sizeuvthreads = 0;
+}
+
+/*
+** Append a touched table to the remembered set, growing it if needed.
+** If that fails, the table is lost and finishgencycle falls back to a
+** major collection, see gc_growindex.
+*/
+static void remember(global_State *g, GCobj *o) {
+  GCRef *top = mref(g->gc.remsettop, GCRef);
+  if (LJ_UNLIKELY(top >= mref(g->gc.remsetlim, GCRef))) {
+    GCRef *rs = mref(g->gc.remset, GCRef);
+    MSize n = (MSize)(top - rs);
+    MSize sz = (MSize)(mref(g->gc.remsetlim, GCRef) - rs);
+    if ((rs = gc_growindex(g, rs, &sz)) == NULL) return;
+    setmref(g->gc.remset, rs);
+    setmref(g->gc.remsetlim, rs + sz);
+    top = rs + n;
+  }
+  setgcref(*top, o);
+  setmref(g->gc.remsettop, top+1);
+}
+
+/* Age the cards of a table. Returns non-zero if any card is still dirty. */
+static int agecards(GCtab *t) {
+  uint8_t *card = tabcards(t);
+  MSize i, n = sizetabcards(t->asize);
+  int dirty = 0;
+  for (i = 0; i < n; i++)
+    if (card[i]) dirty |= --card[i];
+  return dirty;
+}
+
+/*
+** Correct the remembered set after a young collection. 'touched1'
+** tables stay for one more cycle as 'touched2'. 'touched2' tables were
+** not written to since, so they become regular old and are dropped.
+** Unless their cards were written to, which keeps them as 'touched2'.
+*/
+static void correctremset(global_State *g) {
+  GCRef *rs = mref(g->gc.remset, GCRef);
+  GCRef *top = mref(g->gc.remsettop, GCRef);
+  GCRef *p, *q = rs;
+  for (p = rs; p < top; p++) {
+    GCobj *o = gcref(*p);
+    int dirty = 0;
+    lua_assert(!iswhite(o) && isold(o));
+    gray2black(o);
+    if (sizetabcards(gco2tab(o)->asize))
+      dirty = agecards(gco2tab(o));
+    if (getage(o) == G_TOUCHED1 || dirty) {
+      setage(o, G_TOUCHED2);
+      *q++ = *p;
+    } else {
+      setage(o, G_OLD);
+    }
+  }
+  setmref(g->gc.remsettop, q);
+}
+
+/* Free the remembered set, e.g. when leaving generational mode. */
+static void clearremset(global_State *g) {
+  GCRef *rs = mref(g->gc.remset, GCRef);
+  lj_mem_freevec(g, rs, mref(g->gc.remsetlim, GCRef) - rs, GCRef);
+  setmref(g->gc.remset, NULL);
+  setmref(g->gc.remsettop, NULL);
+  setmref(g->gc.remsetlim, NULL);
 }
 
 /*
@@ -920,8 +1635,8 @@ static void whitelist(global_State *g, GCRef p) {
 }
 
 static void whiltestrings(global_State *g) {
-  int i = 0;
-  for (; i < g->strmask; ++i) {
+  MSize i = 0;
+  for (; i <= g->strmask; ++i) {
     whitelist(g, g->strhash[i]);
   }
 }
@@ -941,11 +1656,12 @@ void lj_gc_runtilstate (lua_State *L, int state) {
 ** Correct a list of gray objects. Because this correction is
 ** done after sweeping, young objects can be white and still
 ** be in the list. They are only removed.
-** For tables and userdata, advance 'touched1' to 'touched2'; 'touched2'
-** objects become regular old and are removed from the list.
+** For tables and userdata, advance 'touched1' to 'touched2' and move
+** them to the remembered set; 'touched2' objects become regular old and
+** are removed from the list.
 ** For threads, just remove white ones from the list.
 */
-static GCRef *correctgraylist(GCRef *p, GCRef *root) {
+static GCRef *correctgraylist(lua_State *L, GCRef *p) {
   GCobj *o;
   while ((o = gcref(*p)) != NULL) {
     gc_debug("correctgraylist: %p, %d, %d\n", o, o->gch.gct, getage(o));
@@ -955,7 +1671,10 @@ static GCRef *correctgraylist(GCRef *p, GCRef *root) {
           lua_assert(isgray(o));
           gray2black(o);
           changeage(o, G_TOUCHED1, G_TOUCHED2);
-          p = &o->gch.gclist;
+          if (o->gch.gct == ~LJ_TTAB && sizetabcards(gco2tab(o)->asize))
+            memset(tabcards(gco2tab(o)), 1, sizetabcards(gco2tab(o)->asize));
+          remember(G(L), o);
+          *p = o->gch.gclist;
         }
         else {
           if (!iswhite(o)) {
@@ -985,26 +1704,32 @@ static GCRef *correctgraylist(GCRef *p, GCRef *root) {
 }
 
 /*
-** Correct all gray lists, coalescing them into 'grayagain'.
+** Correct the remembered set and all gray lists, coalescing the lists
+** into 'grayagain'. The remembered set goes first, so tables moved over
+** from the lists are not advanced twice.
 */
-static void correctgraylists(global_State *g) {
+static void correctgraylists(lua_State *L, global_State *g) {
+  correctremset(g);
   gc_debug("correctgraylists: correct grayagain list\n");
-  GCRef *list = correctgraylist(&g->gc.grayagain, &g->gc.grayagain);
+  GCRef *list = correctgraylist(L, &g->gc.grayagain);
   *list = g->gc.weak;
   setgcrefnull(g->gc.weak);
   gc_debug("correctgraylists: correct weak list\n");
-  correctgraylist(list, list);
+  correctgraylist(L, list);
 }
 
 /*
-** Mark 'old1' objects when starting a new young collection.
-** Gray objects are already in some gray list, and so will be visited
-** in the atomic step.
+** Mark 'old1' objects when starting a new young collection. They were
+** recorded by the last sweep, so this is O(old1) and does not walk the
+** survival and old segments. Objects touched since are skipped. Gray
+** objects are already in some gray list, and so will be visited in the
+** atomic step.
 */
-static void markold(global_State *g, GCRef from, GCRef to) {
-  GCobj *o;
-  GCobj *toobj = gcref(to);
-  while ((o = gcref(from)) != toobj) {
+static void markold(global_State *g) {
+  GCRef *v = mref(g->gc.old1, GCRef);
+  MSize i, n = g->gc.old1num;
+  for (i = 0; i < n; i++) {
+    GCobj *o = gcref(v[i]);
     gc_debug5("markold: %p, %d\n", o, getage(o));
     if (getage(o) == G_OLD1) {
       gc_debug("markold: %p\n", o);
@@ -1014,18 +1739,10 @@ static void markold(global_State *g, GCRef from, GCRef to) {
         gc_mark(g, o);
       }
     }
-    from = o->gch.nextgc;
   }
 }
 
 
-static void markstringold(global_State *g) {
-  int i = 0;
-  for (; i < g->strmask; ++i) {
-    markold(g, g->strhash[i], empty);
-  }
-}
-
 /*
 ** call all pending finalizers
 */
@@ -1035,86 +1752,112 @@ static void callallpendingfinalizers (lua_State *L) {
     gc_finalize(L);
 }
 
+static void minor2inc(global_State *g);
+
 /*
-** Finish a young-generation collection.
+** Finish a young-generation collection. If one of the indexes could
+** not be grown, the young collections cannot trust them anymore. Start
+** a major collection right away, which rebuilds them in atomic2gen.
 */
 static void finishgencycle(lua_State *L, global_State *g) {
-  correctgraylists(g);
+  correctgraylists(L, g);
   g->gc.state = GCSpropagate;
+  if (LJ_UNLIKELY(g->gc.genlost)) {
+    gc_debug2("finishgencycle: index lost, major collection\n");
+    g->gc.genlost = 0;
+    minor2inc(g);
+    g->gc.threshold = g->gc.total;  /* Start the incremental cycle now. */
+  }
   callallpendingfinalizers(L);
 }
 
 /*
-** Does a young collection. First, mark 'old1' objects.  (Only survival
-** and "recent old" lists can contain 'old1' objects. New lists cannot
-** contain 'old1' objects, at most 'old0' objects that were already
-** visited when marked old.) Then does the atomic step. Then,
-** sweep all lists and advance pointers. Finally, finish the collection.
+** Starts a young collection by marking 'old1' objects. The gray objects
+** are then propagated by genstep, either at once or spread over several
+** steps.
 */
-static void youngcollection(lua_State *L, global_State *g) {
-  gc_debug2("youngcollection: \n");
+static void youngstart(global_State *g) {
   lua_assert(g->gc.state == GCSpropagate);
-  enter(NULL);
-  gc_debug3("mark gcobj: %p, %p\n", gcref(g->gc.surival), gcref(g->gc.reallyold));
-  markold(g, g->gc.surival, g->gc.reallyold);
-  leave("mark old1", NULL);
-
-  enter(NULL);
-  gc_debug3("mark udata: %p, %p\n", gcref(g->gc.udatasur), gcref(g->gc.udatarold));
-  markold(g, g->gc.udatasur, g->gc.udatarold);
-  leave("mark old2", NULL);
-
-  // 特殊处理字符串;
-  gc_debug3("mark string:\n");
-  markstringold(g);
+  gc_stats_phase(g, GCPHASE_markold);
+  markold(g);
+  gc_stats_phase(g, GCPHASE_propagate);
+  g->gc.youngmark = 1;
+}
 
-  enter(NULL);
+/*
+** Finishes a young collection. Does the atomic step. Then, sweep all
+** lists and advance pointers. Finally, finish the collection.
+*/
+static void youngcollection(lua_State *L, global_State *g) {
+  gc_debug2("youngcollection: \n");
+  lua_assert(g->gc.state == GCSpropagate && g->gc.youngmark);
+  GCSize before = g->gc.total;
+  g->gc.youngmark = 0;
   atomic(g, L);
-  leave("atomic", NULL);
 
-  enter(NULL);
+  gc_stats_phase(g, GCPHASE_sweepgen);
+  g->gc.old1num = 0;  /* Rebuilt by the sweeps below. */
+  sweepyounguv(L, g);
   GCRef *psurvival = sweepgen(L, g, &g->gc.root, g->gc.surival, NULL);
   sweepgen(L, g, psurvival, g->gc.reallyold, &g->gc.old);
-  leave("sweepgen1", NULL);
   g->gc.reallyold = g->gc.old;
   g->gc.old = *psurvival;
   g->gc.surival = g->gc.root;
 
-  sweepstringsgen(L);
+  sweepyoungstr(g);
 
-  enter(NULL);
   psurvival = sweepgen(L, g, &mainthread(g)->nextgc, g->gc.udatasur, NULL);
   sweepgen(L, g, psurvival, g->gc.udatarold, &g->gc.udataold);
-  leave("sweepgen2", NULL);
   gc_debug3("udata after gen: %p %p %p, %p\n", gcref(mainthread(g)->nextgc), gcref(g->gc.udatasur), gcref(g->gc.udataold), gcref(g->gc.udatarold));
   g->gc.udatarold = g->gc.udataold;
   g->gc.udataold = *psurvival;
   g->gc.udatasur = mainthread(g)->nextgc;
   gc_debug3("udata after: %p %p, %p\n", gcref(g->gc.udatasur), gcref(g->gc.udataold), gcref(g->gc.udatarold));
 
-  enter(NULL);
+  gcstats(g)->minor++;
+  if (before > g->gc.total)
+    gcstats(g)->freedyoung += before - g->gc.total;
+  if (g->gc.total > g->gc.minorbase)
+    gcstats(g)->promoted += g->gc.total - g->gc.minorbase;
+
+  gc_stats_phase(g, GCPHASE_finishgen);
   finishgencycle(L, g);
-  leave("finishgencycle", NULL);
 }
 
-// 进入到分代模式，进行一次完整的标记操作，之后把所有存活的打上old标记
-static void entergen(lua_State *L, global_State *g) {
-  lj_gc_runtilstate(L, GCSpause);
-  lj_gc_runtilstate(L, GCSpropagate);
-  atomic(g, L);
-
+/*
+** Turn everything that survived the atomic phase into old objects and
+** switch to generational mode.
+*/
+static void atomic2gen(lua_State *L, global_State *g) {
+  GCSize before = g->gc.total;
+  lua_assert(g->gc.old1num == 0 && g->gc.uvthreadnum == 0);
+  gc_stats_phase(g, GCPHASE_sweep);
   // 标记所有对象为old;
   sweep2old(L, &g->gc.root);
   sweepstringsold(L);
+  gcstats(g)->freedold += before - g->gc.total;
+  g->gc.youngstrnum = 0;
 
   g->gc.reallyold = g->gc.old = g->gc.surival = g->gc.root;
 
   g->gc.udatarold = g->gc.udataold = g->gc.udatasur = mainthread(g)->nextgc;
 
   g->gc.kind = KGC_GEN;
+  g->gc.youngmark = 0;
+  g->gc.genbad = 0;
   g->gc.estimate = g->gc.total;
   g->gc.threshold = (g->gc.total / 100) * (100 + g->gc.genminormul);
   finishgencycle(L, g);
+  g->gc.minorbase = g->gc.total;
+}
+
+// 进入到分代模式，进行一次完整的标记操作，之后把所有存活的打上old标记
+static void entergen(lua_State *L, global_State *g) {
+  lj_gc_runtilstate(L, GCSpause);
+  lj_gc_runtilstate(L, GCSpropagate);
+  atomic(g, L);
+  gcstats(g)->major++;
+  atomic2gen(L, g);
 }
 
 static void enterinc(global_State *g) {
@@ -1125,9 +1868,77 @@ static void enterinc(global_State *g) {
 
   // 遍历所有字符串;
   whiltestrings(g);
+  clearyoungstr(g);
+  clearremset(g);
+  clearold1(g);
+  clearyounguv(g);
 
   g->gc.state = GCSpause;
   g->gc.kind = KGC_INC;
+  g->gc.youngmark = 0;
+  g->gc.genbad = 0;
+}
+
+/*
+** Start an incremental major collection in generational mode. The
+** cycle begins with an incremental sweep, which turns every object white
+** again and resets its age, instead of the stop-the-world whitelist of
+** enterinc. atomic2gen switches back to generational mode at the end
+** of the mark phase.
+*/
+static void minor2inc(global_State *g) {
+  lua_assert(!g->gc.youngmark);
+  setgcrefnull(g->gc.reallyold);
+  setgcrefnull(g->gc.old);
+  setgcrefnull(g->gc.surival);
+  setgcrefnull(g->gc.udatasur);
+  setgcrefnull(g->gc.udataold);
+  setgcrefnull(g->gc.udatarold);
+  clearyoungstr(g);
+  clearremset(g);
+  clearold1(g);
+  clearyounguv(g);
+  setgcrefnull(g->gc.gray);  /* Reset lists from generational mode. */
+  setgcrefnull(g->gc.grayagain);
+  setgcrefnull(g->gc.weak);
+  setmref(g->gc.sweep, &g->gc.root);
+  g->gc.sweepstr = 0;
+  g->gc.state = GCSsweepstring;
+  g->gc.kind = KGC_GENMAJOR;
+  g->gc.genbad = 0;
+}
+
+/*
+** Check whether a minor collection paid off. If more than 'genbadmul'%
+** of the memory allocated since the previous minor collection survived,
+** the program is building up data and young collections just waste
+** time. Fall back to incremental cycles until the heap is stable again.
+*/
+static void genbadcheck(global_State *g, GCSize before) {
+  GCSize after = g->gc.total, base = g->gc.minorbase;
+  g->gc.minorbase = after;
+  if (g->gc.genbadmul == 0 || before <= base || after <= base)
+    return;
+  if ((after - base) / g->gc.genbadmul >= (before - base) / 100) {
+    gc_debug2("genbadcheck: bad collection: %ld, %ld, %ld\n", base, before, after);
+    minor2inc(g);
+    g->gc.genbad = 1;
+    g->gc.lastestimate = g->gc.total;
+    g->gc.threshold = g->gc.total;  /* Start the incremental cycle now. */
+  }
+}
+
+/*
+** Called at the end of each incremental cycle after a bad collection.
+** Once the live heap grows by less than 'genstablemul'% per cycle, the
+** next cycle ends with atomic2gen and switches back to generational mode.
+*/
+static void genstable(global_State *g) {
+  GCSize last = g->gc.lastestimate;
+  if (g->gc.estimate <= last + (last / 100) * g->gc.genstablemul)
+    g->gc.genbad = 0;
+  else
+    g->gc.lastestimate = g->gc.estimate;
 }
 
 /*
@@ -1137,6 +1948,8 @@ static void fullgen(lua_State *L, global_State *g) {
   gc_debug2("fullgen: \n");
   enterinc(g);
   entergen(L, g);
+  if (g->gc.autotrim)
+    lj_gc_trim(g);
 }
 
 /*
@@ -1146,54 +1959,98 @@ static void fullgen(lua_State *L, global_State *g) {
 ** another collection when memory grows 'genminormul'% larger.
 ** 一次分代gc step，会stop the world直到gc完成;
 ** 可以通过genmajormul和genminormul来控制分代full gc和分代young gc的时机;
+** With a non-zero 'genstepmul' the work is spread over several steps,
+** accounted like incstep: the mark phase of a young collection is
+** propagated GCSTEPSIZE/100*genstepmul bytes at a time, and a major
+** collection continues as an incremental cycle (see minor2inc).
+** Returns 1 when a collection was finished, like incstep.
 */
-static void genstep(lua_State *L, global_State *g) {
+static int genstep(lua_State *L, global_State *g) {
   MSize majorbase = g->gc.estimate;
-  int majormul = getgcparam(g->gc.genmajormul);
-  gc_debug2("genstep: %d, %d, %ld, %ld\n", majorbase, majormul, g->gc.total, g->gc.threshold);
-  if (g->gc.total > g->gc.threshold && g->gc.total > (majorbase / 100) * (100 + majormul))
-    fullgen(L, g);
-  else {
-    youngcollection(L, g);
-    MSize mem = g->gc.total;
-    g->gc.threshold = (mem / 100) * (100 + g->gc.genminormul);
-    g->gc.estimate = majorbase;
+  GCSize lim;
+  if (!g->gc.youngmark) {
+    int majormul = getgcparam(g->gc.genmajormul);
+    gc_debug2("genstep: %d, %d, %ld, %ld\n", majorbase, majormul, g->gc.total, g->gc.threshold);
+    if (g->gc.total > g->gc.threshold && g->gc.total > (majorbase / 100) * (100 + majormul)) {
+      if (g->gc.genstepmul == 0) {
+        gcstats(g)->cycle = GCCYCLE_full;
+        fullgen(L, g);
+        return 1;
+      }
+      gcstats(g)->cycle = GCCYCLE_major;
+      minor2inc(g);
+      return incstep(L);
+    }
+    youngstart(g);
+  }
+  /* Without a step budget everything is propagated in the atomic phase. */
+  lim = (GCSTEPSIZE/100) * g->gc.genstepmul;
+  while (lim && gcref(g->gc.gray) != NULL) {
+    lim -= (GCSize)propagatemark(g);
+    if (sizeof(lim) == 8 ? ((int64_t)lim <= 0) : ((int32_t)lim <= 0)) {
+      g->gc.threshold = g->gc.total + GCSTEPSIZE;
+      return -1;
+    }
   }
+  GCSize before = g->gc.total;
+  youngcollection(L, g);
+  if (g->gc.kind != KGC_GEN)  /* Degraded by finishgencycle. */
+    return 1;
+  MSize mem = g->gc.total;
+  g->gc.threshold = (mem / 100) * (100 + g->gc.genminormul);
+  g->gc.estimate = majorbase;
+  genbadcheck(g, before);
   gc_debug2("genstep end: %ld, %ld, %ld\n", g->gc.estimate, g->gc.total, g->gc.threshold);
+  return 1;
 }
 
 int LJ_FASTCALL lj_gc_step(lua_State *L) {
   gc_debug2("lj_gc_step: \n");
   global_State *g = G(L);
-  long long begin;
-  enter(&begin);
-  if (g->gc.kind == KGC_INC)
-    return incstep(L);
-  else
-    genstep(L, g);
-  leave("lj_gc_step: ", &begin);
-  return 1;
+  int32_t ostate = g->vmstate;
+  int res;
+  setvmstate(g, GC);
+  gc_stats_begin(g);
+  if (g->gc.kind == KGC_GEN) {
+    gcstats(g)->cycle = GCCYCLE_young;
+    res = genstep(L, g);
+  } else {
+    gcstats(g)->cycle = (g->gc.kind == KGC_GENMAJOR && !g->gc.genbad) ?
+			GCCYCLE_major : GCCYCLE_inc;
+    res = incstep(L);
+  }
+#if LJ_HASGCTHREAD
+  lj_gcthread_flush(g);
+#endif
+  gc_stats_end(g);
+  g->vmstate = ostate;
+  return res;
 }
 
 // 更改gc模式;
 void lj_gc_changemode(lua_State *L, int newmode) {
   global_State *g = G(L);
-  if (newmode != g->gc.kind) {
+  if ((newmode == KGC_INC) != (g->gc.kind == KGC_INC)) {
+    int32_t ostate = g->vmstate;
+    setvmstate(g, GC);
+    gc_stats_begin(g);
+    gcstats(g)->cycle = GCCYCLE_full;
     if (newmode == KGC_GEN)
       entergen(L, g);
     else
       enterinc(g);
+    gc_stats_end(g);
+    g->vmstate = ostate;
   }
 }
 
 static void fullinc(lua_State *L, global_State *g) {
-  int32_t ostate = g->vmstate;
-  setvmstate(g, GC);
   if (g->gc.state <= GCSatomic) {  /* Caught somewhere in the middle. */
     setmref(g->gc.sweep, &g->gc.root);  /* Sweep everything (preserving it). */
     setgcrefnull(g->gc.gray);  /* Reset lists from partial propagation. */
     setgcrefnull(g->gc.grayagain);
     setgcrefnull(g->gc.weak);
+    setmref(g->gc.remsettop, mref(g->gc.remset, GCRef));
     g->gc.state = GCSsweepstring;  /* Fast forward to the sweep phase. */
     g->gc.sweepstr = 0;
   }
@@ -1202,19 +2059,229 @@ static void fullinc(lua_State *L, global_State *g) {
   lua_assert(g->gc.state == GCSfinalize || g->gc.state == GCSpause);
   /* Now perform a full GC. */
   g->gc.state = GCSpause;
-  do { gc_onestep(L); } while (g->gc.state != GCSpause);
+  do {
+    if (g->gc.state == GCSpropagate)
+      gc_propagate_all(g);  /* Mark everything in one go. */
+    gc_onestep(L);
+  } while (g->gc.state != GCSpause);
   g->gc.threshold = (g->gc.estimate/100) * g->gc.pause;
-  g->vmstate = ostate;
+  if (g->gc.autotrim)
+    lj_gc_trim(g);
 }
 
 /* Perform a full GC cycle. */
 void lj_gc_fullgc(lua_State *L)
 {
   global_State *g = G(L);
+  int32_t ostate = g->vmstate, ocycle = gcstats(g)->cycle;
+  setvmstate(g, GC);
+  gc_stats_begin(g);
+  gcstats(g)->cycle = GCCYCLE_full;
+  g->gc.fullmark = 1;
   if (g->gc.kind == KGC_INC)
     fullinc(L, g);
   else
     fullgen(L, g);
+  g->gc.fullmark = 0;
+#if LJ_HASGCTHREAD
+  lj_gcthread_flush(g);
+#endif
+  gc_stats_end(g);
+  gcstats(g)->cycle = ocycle;  /* May be nested in a step via __gc. */
+  g->vmstate = ostate;
+}
+
+/*
+** Set the number of helper threads for marking. Returns the old number.
+** The helpers are kept in a pool until the number changes again or the
+** state is closed. Fewer helpers are used if some fail to start.
+*/
+int lj_gc_setmarkers(lua_State *L, int n)
+{
+  global_State *g = G(L);
+  int old = g->gc.nmarkers;
+#if LJ_HASGCTHREAD
+  GCMarkState *ms = mref(g->gc.markstate, GCMarkState);
+  if (n < 0) n = 0;
+  else if (n > LJ_GC_MAXMARKERS) n = LJ_GC_MAXMARKERS;
+  if (n == old)
+    return old;
+  if (ms) {
+    lj_gcthread_poolstop(g, ms->pool);
+    lj_mem_free(g, ms, sizeof(GCMarkState));
+    setmref(g->gc.markstate, NULL);
+    g->gc.nmarkers = 0;
+  }
+  if (n) {
+    ms = lj_mem_newt(L, sizeof(GCMarkState), GCMarkState);
+    ms->g = g;
+    ms->pool = lj_gcthread_poolstart(g, n);
+    if (ms->pool) {
+      setmref(g->gc.markstate, ms);
+      n = lj_gcthread_poolsize(ms->pool);
+    } else {
+      lj_mem_free(g, ms, sizeof(GCMarkState));
+      n = 0;
+    }
+  }
+  g->gc.nmarkers = (uint8_t)n;
+#else
+  UNUSED(L); UNUSED(n);
+#endif
+  return old;
+}
+
+/*
+** Set the nursery size in KB (0: off). Returns the old size. A nursery
+** that still holds objects keeps its size and is only switched on or off.
+*/
+int lj_gc_setnursery(lua_State *L, int kb)
+{
+  global_State *g = G(L);
+  GCNursery *n = mref(g->gc.nursery, GCNursery);
+  int old = (n && n->on) ? (int)((n->end - n->base) >> 10) : 0;
+  if (kb < 0) kb = 0;
+  else if (kb > LJ_GC_NMAXKB) kb = LJ_GC_NMAXKB;
+  if (n && n->nlive == 0 && (kb == 0 || kb != (int)((n->end - n->base) >> 10))) {
+    g->allocf(g->allocd, n, n->size, 0);
+    setmref(g->gc.nursery, NULL);
+    n = NULL;
+  }
+  if (n) {
+    n->on = (kb != 0);
+  } else if (kb) {
+    MSize i, nblocks = ((MSize)kb << 10) >> LJ_GC_NBLOCKSHIFT;
+    size_t hsz;
+    if (nblocks == 0) nblocks = 1;
+    hsz = sizeof(GCNursery) + 2*nblocks*sizeof(MSize);
+    n = (GCNursery *)g->allocf(g->allocd, NULL, 0,
+			       hsz + ((size_t)nblocks << LJ_GC_NBLOCKSHIFT) + 15);
+    if (n == NULL)
+      return old;  /* Not fatal, just run without a nursery. */
+    n->size = hsz + ((size_t)nblocks << LJ_GC_NBLOCKSHIFT) + 15;
+    n->base = (char *)(((uintptr_t)n + hsz + 15) & ~(uintptr_t)15);
+    n->end = n->base + ((size_t)nblocks << LJ_GC_NBLOCKSHIFT);
+    n->top = n->lim = NULL;
+    n->cur = n->nblocks = n->nfree = nblocks;
+    n->nlive = 0;
+    n->free = (MSize *)(n + 1);
+    n->live = n->free + nblocks;
+    for (i = 0; i < nblocks; i++) {
+      n->free[i] = nblocks-1-i;  /* Start with the lowest block. */
+      n->live[i] = 0;
+    }
+    n->on = 1;
+    lua_assert(checkptrGC(n->end));
+    setmref(g->gc.nursery, n);
+  }
+  return old;
+}
+
+/* Return free memory of the bundled allocator to the OS. Returns bytes. */
+size_t lj_gc_trim(global_State *g)
+{
+  size_t n = 0;
+#ifndef LUAJIT_USE_SYSMALLOC
+  void *ud = g->allocd;
+  lua_Alloc f = g->allocf;
+#if LJ_HASGCTHREAD
+  if (lj_gcthread_active(g)) {
+    f = lj_gcthread_getallocf(g, &ud);
+    if (f == lj_alloc_f) {
+      lj_gcthread_flush(g);
+      lj_gcthread_lock(g);
+      n = lj_alloc_trim(ud);
+      lj_gcthread_unlock(g);
+    }
+    return n;
+  }
+#endif
+  if (f == lj_alloc_f)
+    n = lj_alloc_trim(ud);
+#else
+  UNUSED(g);
+#endif
+  return n;
+}
+
+/* Size of a GC object including its parts, as released by its free function. */
+static GCSize gc_objsize(global_State *g, GCobj *o)
+{
+  switch (o->gch.gct) {
+  case ~LJ_TSTR:
+    return sizestring(gco2str(o));
+  case ~LJ_TUPVAL:
+    return sizeof(GCupval);
+  case ~LJ_TTHREAD:
+    return sizeof(lua_State) + gco2th(o)->stacksize*sizeof(TValue);
+  case ~LJ_TPROTO:
+    return gco2pt(o)->sizept;
+  case ~LJ_TFUNC:
+    return isluafunc(&o->fn) ? sizeLfunc((MSize)o->fn.l.nupvalues) :
+			       sizeCfunc((MSize)o->fn.c.nupvalues);
+  case ~LJ_TTAB: {
+    GCtab *t = gco2tab(o);
+    GCSize sz = (LJ_MAX_COLOSIZE != 0 && t->colo) ?
+		sizetabcolo((uint32_t)t->colo & 0x7f) : sizeof(GCtab);
+    if (t->asize > 0 && t->colo <= 0)  /* Plus its card table, if any. */
+      sz += t->asize*sizeof(TValue) + sizetabcards(t->asize);
+    if (t->hmask > 0)
+      sz += (t->hmask+1)*sizeof(Node);
+    return sz;
+    }
+#if LJ_HASJIT
+  case ~LJ_TTRACE: {
+    GCtrace *T = gco2trace(o);
+    return ((sizeof(GCtrace)+7)&~7) + (T->nins-T->nk)*sizeof(IRIns) +
+	   T->nsnap*sizeof(SnapShot) + T->nsnapmap*sizeof(SnapEntry);
+    }
+#endif
+#if LJ_HASFFI
+  case ~LJ_TCDATA: {
+    GCcdata *cd = gco2cd(o);
+    if (cdataisv(cd)) {
+      return sizecdatav(cd);
+    } else {
+      CType *ct = ctype_raw(ctype_ctsG(g), cd->ctypeid);
+      return sizeof(GCcdata) + (ctype_hassize(ct->info) ? ct->size : CTSIZE_PTR);
+    }
+    }
+#endif
+  case ~LJ_TUDATA:
+    return sizeudata(gco2ud(o));
+  default:
+    lua_assert(0);
+    return 0;
+  }
+}
+
+/* Add the objects of a GC list to the per-type statistics. */
+static void gc_heapstats_list(global_State *g, GCobj *o, GCobj *stop,
+			      GCSize *bytes, GCSize *num)
+{
+  for (; o != NULL; o = gcref(o->gch.nextgc)) {
+    bytes[o->gch.gct] += gc_objsize(g, o);
+    num[o->gch.gct]++;
+    if (gcref(o->gch.nextgc) == stop) break;
+  }
+}
+
+/*
+** Count the objects and their bytes per type, indexed by ~itype. This
+** includes dead objects which have not been swept yet.
+*/
+void lj_gc_heapstats(global_State *g, GCSize *bytes, GCSize *num)
+{
+  GCobj *mmudata = gcref(g->gc.mmudata);
+  MSize i;
+  memset(bytes, 0, LJ_GC_NTYPES*sizeof(GCSize));
+  memset(num, 0, LJ_GC_NTYPES*sizeof(GCSize));
+  gc_heapstats_list(g, gcref(g->gc.root), NULL, bytes, num);
+  for (i = 0; i <= g->strmask; i++)
+    gc_heapstats_list(g, gcref(g->strhash[i]), NULL, bytes, num);
+  if (mmudata)  /* Circular list, mmudata points to its last entry. */
+    gc_heapstats_list(g, gcref(mmudata->gch.nextgc), gcref(mmudata->gch.nextgc),
+		      bytes, num);
 }
 
 /* -- Write barriers ------------------------------------------------------ */
@@ -1246,11 +2313,19 @@ void LJ_FASTCALL lj_gc_barrieruv(global_State *g, TValue *tv)
   gc_debug6("lj_gc_barrieruv: %p\n", gcV(tv));
 #define TV2MARKED(x) \
   (*((uint8_t *)(x) - offsetof(GCupval, tv) + offsetof(GCupval, marked)))
-  if (g->gc.state == GCSpropagate || g->gc.state == GCSatomic)
-    gc_mark(g, gcV(tv));
-  else
+#define TV2AGE(x) \
+  (*((uint8_t *)(x) - offsetof(GCupval, tv) + offsetof(GCupval, age)))
+  if (g->gc.state == GCSpropagate || g->gc.state == GCSatomic) {
+    GCobj *v = gcV(tv);
+    gc_mark(g, v);
+    if (TV2AGE(tv) > G_SURVIVAL) {  /* Old upvalue must not lose a new value. */
+      lua_assert(!isold(v));
+      setage(v, G_OLD0);
+    }
+  } else
     TV2MARKED(tv) = (TV2MARKED(tv) & (uint8_t)~LJ_GC_COLORS) | curwhite(g);
 #undef TV2MARKED
+#undef TV2AGE
 }
 
 /* Close upvalue. Also needs a write barrier. */
@@ -1299,6 +2374,16 @@ void *lj_mem_realloc(lua_State *L, void *p, GCSize osz, GCSize nsz)
 {
   global_State *g = G(L);
   lua_assert((osz == 0) == (p == NULL));
+  lua_assert(!lj_gc_innursery(mref(g->gc.nursery, GCNursery), p));
+#if LJ_HASPROFILE
+  /* Sample before the call, while a reallocated stack is still valid. */
+  if (nsz > osz) {
+    if (LJ_UNLIKELY(nsz - osz >= g->gc.allocleft))
+      lj_profile_allocsample(L, NULL, nsz - osz);
+    else
+      g->gc.allocleft -= nsz - osz;
+  }
+#endif
   p = g->allocf(g->allocd, p, osz, nsz);
   if (p == NULL && nsz > 0)
     lj_err_mem(L);
@@ -1310,19 +2395,52 @@ void *lj_mem_realloc(lua_State *L, void *p, GCSize osz, GCSize nsz)
   return p;
 }
 
+/* Bump-allocate from the nursery. Returns NULL if it is full. */
+static GCobj *gc_nurseryalloc(GCNursery *n, GCSize size)
+{
+  char *p;
+  size = (size + 7) & ~(GCSize)7;
+  if (LJ_UNLIKELY(n->top + size > n->lim)) {  /* Switch to an empty block. */
+    MSize b;
+    if (n->nfree == 0)
+      return NULL;
+    b = n->free[--n->nfree];
+    n->cur = b;
+    n->top = n->base + ((size_t)b << LJ_GC_NBLOCKSHIFT);
+    n->lim = n->top + LJ_GC_NBLOCKSIZE;
+  }
+  p = n->top;
+  n->top += size;
+  n->live[n->cur]++;
+  n->nlive++;
+  return (GCobj *)p;
+}
+
 /* Allocate new GC object and link it to the root set. */
 void * LJ_FASTCALL lj_mem_newgco(lua_State *L, GCSize size)
 {
   global_State *g = G(L);
-  GCobj *o = (GCobj *)g->allocf(g->allocd, NULL, 0, size);
-  if (o == NULL)
-    lj_err_mem(L);
+  GCNursery *n = mref(g->gc.nursery, GCNursery);
+  GCobj *o = NULL;
+  if (n && n->on && g->gc.kind == KGC_GEN && size <= LJ_GC_NMAXOBJ)
+    o = gc_nurseryalloc(n, size);
+  if (o == NULL) {
+    o = (GCobj *)g->allocf(g->allocd, NULL, 0, size);
+    if (o == NULL)
+      lj_err_mem(L);
+  }
   lua_assert(checkptrGC(o));
   g->gc.total += size;
   setgcrefr(o->gch.nextgc, g->gc.root);
   setgcref(g->gc.root, o);
   newwhite(g, o);
   setage(o, G_NEW);
+#if LJ_HASPROFILE
+  if (LJ_UNLIKELY(size >= g->gc.allocleft))
+    lj_profile_allocsample(L, o, size);
+  else
+    g->gc.allocleft -= size;
+#endif
   gc_debug5("lj_mem_newgco: %p\n", o);
   gc_debug6("lj_mem_newgco: %p\n", o);
   return o;
@@ -23,6 +23,7 @@ enum {
 #define LJ_GC_CDATA_FIN	0x10
 #define LJ_GC_FIXED	0x20
 #define LJ_GC_SFIXED	0x40
+#define LJ_GC_FROZEN	0x80	/* Frozen table. Same bit as cdataisv(). */
 
 #define LJ_GC_WHITES	(LJ_GC_WHITE0 | LJ_GC_WHITE1)
 #define LJ_GC_COLORS	(LJ_GC_WHITES | LJ_GC_BLACK)
@@ -63,10 +64,36 @@ enum {
 #define changeage(o,f,t)  \
 	check_exp(getage(o) == (f), (o)->gch.age = (t))
 
+/*
+** Card marking for the array part of large tables in generational mode.
+** A card table is kept in front of the array part, growing downwards:
+** the byte at array[-1] covers the hash part and the metatable and the
+** card for array slot i is at ((uint8_t *)array)[-2-(i>>LJ_GC_CARDSHIFT)].
+** Cards age like G_TOUCHED1/G_TOUCHED2: a written card is rescanned by
+** the next two minor collections.
+*/
+#define LJ_GC_CARDMIN	1024	/* Min. array size with a card table. */
+#define LJ_GC_CARDSHIFT	7	/* log2 of slots per card. */
+#define LJ_GC_CARDDIRTY	2	/* Card written in this cycle. */
+
+/* Size of the card table (a multiple of the TValue size) or 0. */
+#define sizetabcards(n) \
+  ((n) >= LJ_GC_CARDMIN ? \
+   (((((n) + (1u<<LJ_GC_CARDSHIFT)-1) >> LJ_GC_CARDSHIFT) + 1 + 7) & ~7u) : 0)
+#define tabcards(t)	((uint8_t *)tvref((t)->array) - sizetabcards((t)->asize))
+#define tabcard(t, i)	((uint8_t *)tvref((t)->array) - 2 - ((i) >> LJ_GC_CARDSHIFT))
+#define tabhcard(t)	((uint8_t *)tvref((t)->array) - 1)
+
+/* Max. number of helper threads for parallel marking. */
+#define LJ_GC_MAXMARKERS	16
+
   /* Default Values for GC parameters */
 // 分步gc默认参数;
 #define LUAI_GENMAJORMUL         100
 #define LUAI_GENMINORMUL         20
+#define LUAI_GENSTEPMUL          0	/* 0: minor/major cycles in one step */
+#define LUAI_GENBADMUL           0	/* 0: never leave generational mode */
+#define LUAI_GENSTABLEMUL        12
 
 /* wait memory to double before starting new cycle */
 // 分步gc暂停默认参数;
@@ -95,6 +122,7 @@ LJ_FUNCA void LJ_FASTCALL lj_gc_step_fixtop(lua_State *L);
 LJ_FUNC int LJ_FASTCALL lj_gc_step_jit(global_State *g, MSize steps);
 #endif
 LJ_FUNC void lj_gc_fullgc(lua_State *L);
+LJ_FUNC int lj_gc_setmarkers(lua_State *L, int n);
 
 /* GC check: drive collector forward if the GC threshold has been reached. */
 #define lj_gc_check(L) \
@@ -112,17 +140,29 @@ LJ_FUNC void lj_gc_closeuv(global_State *g, GCupval *uv);
 LJ_FUNC void lj_gc_barriertrace(global_State *g, uint32_t traceno);
 #endif
 
-/* Move the GC propagation frontier back for tables (make it gray again). */
+/*
+** Move the GC propagation frontier back for tables (make it gray again).
+** The table is appended to the remembered set (gc.remset), which is
+** scanned by the atomic phase. grayagain only takes the overflow.
+** A G_TOUCHED2 table is already remembered. It may stay black when the
+** VM only dirties one of its cards, see gc_traverse_cards.
+*/
 static LJ_AINLINE void lj_gc_barrierback(global_State *g, GCtab *t)
 {
   gc_debug("lj_gc_barrierback: %p\n", t);
   GCobj *o = obj2gco(t);
   lua_assert(isblack(o) && !isdead(g, o));
   lua_assert(g->gc.state != GCSfinalize && g->gc.state != GCSpause);
-  if (getage(o) != G_TOUCHED2) {
-    gc_debug("lj_gc_barrierback: add to grayagain: %p\n", t);
-    setgcrefr(t->gclist, g->gc.grayagain);
-    setgcref(g->gc.grayagain, o);
+  if (getage(o) != G_TOUCHED2) {  /* Not yet remembered? */
+    GCRef *top = mref(g->gc.remsettop, GCRef);
+    if (LJ_LIKELY(top < mref(g->gc.remsetlim, GCRef))) {
+      setgcref(*top, o);
+      setmref(g->gc.remsettop, top+1);
+    } else {  /* Remembered set is full, use grayagain instead. */
+      gc_debug("lj_gc_barrierback: add to grayagain: %p\n", t);
+      setgcrefr(t->gclist, g->gc.grayagain);
+      setgcref(g->gc.grayagain, o);
+    }
   }
   black2gray(o);
   setage(o, G_TOUCHED1);
@@ -147,6 +187,58 @@ static LJ_AINLINE void lj_gc_barrierback(global_State *g, GCtab *t)
   { if (iswhite(obj2gco(o)) && isblack(obj2gco(p))) \
       lj_gc_barrierf(G(L), obj2gco(p), obj2gco(o)); }
 
+/*
+** Optional nursery for young objects in generational mode. Small GC
+** objects are bump-allocated from fixed-size blocks of one contiguous
+** region. Objects never move, so the sweep still frees them one by one,
+** but that only decrements the live count of their block. A block is
+** reused as a whole once all of its objects are dead.
+*/
+#define LJ_GC_NBLOCKSHIFT	15	/* log2 of the block size. */
+#define LJ_GC_NBLOCKSIZE	((size_t)1 << LJ_GC_NBLOCKSHIFT)
+#define LJ_GC_NMAXOBJ		512	/* Max. object size in the nursery. */
+#define LJ_GC_NMAXKB		(1024*1024)  /* Max. nursery size in KB. */
+
+typedef struct GCNursery {
+  char *base;		/* Start of the first block. */
+  char *end;		/* End of the last block. */
+  char *top;		/* Next free byte in the current block. */
+  char *lim;		/* End of the current block. */
+  size_t size;		/* Size of the allocation holding the nursery. */
+  MSize cur;		/* Current block or nblocks. */
+  MSize nblocks;	/* Number of blocks. */
+  MSize nfree;		/* Number of entries in free. */
+  MSize nlive;		/* Live objects in the nursery. */
+  MSize *free;		/* Stack of empty blocks. */
+  MSize *live;		/* Live objects per block. */
+  int on;		/* Allocate new objects from the nursery. */
+} GCNursery;
+
+#define lj_gc_innursery(n, p) \
+  ((n) && (char *)(p) >= (n)->base && (char *)(p) < (n)->end)
+
+LJ_FUNC int lj_gc_setnursery(lua_State *L, int kb);
+
+/* Statistics per object type, see lj_gc_heapstats. */
+#define LJ_GC_NTYPES		(~LJ_TUDATA+1)
+
+LJ_FUNC void lj_gc_heapstats(global_State *g, GCSize *bytes, GCSize *num);
+LJ_FUNC size_t lj_gc_trim(global_State *g);
+
+/* Release an object in the nursery. */
+static LJ_AINLINE void lj_gc_nurseryfree(GCNursery *n, void *p)
+{
+  MSize b = (MSize)(((char *)p - n->base) >> LJ_GC_NBLOCKSHIFT);
+  lua_assert(n->live[b] > 0);
+  n->nlive--;
+  if (--n->live[b] == 0) {
+    if (b == n->cur)  /* Rewind the current block. */
+      n->top = n->base + ((size_t)b << LJ_GC_NBLOCKSHIFT);
+    else
+      n->free[n->nfree++] = b;
+  }
+}
+
 /* Allocator. */
 LJ_FUNC void *lj_mem_realloc(lua_State *L, void *p, GCSize osz, GCSize nsz);
 LJ_FUNC void * LJ_FASTCALL lj_mem_newgco(lua_State *L, GCSize size);
@@ -157,8 +249,12 @@ LJ_FUNC void *lj_mem_grow(lua_State *L, void *p,
 
 static LJ_AINLINE void lj_mem_free(global_State *g, void *p, size_t osize)
 {
+  GCNursery *n = mref(g->gc.nursery, GCNursery);
   g->gc.total -= (GCSize)osize;
-  g->allocf(g->allocd, p, osize, 0);
+  if (LJ_UNLIKELY(lj_gc_innursery(n, p)))
+    lj_gc_nurseryfree(n, p);
+  else
+    g->allocf(g->allocd, p, osize, 0);
 }
 
 #define lj_mem_newvec(L, n, t)	((t *)lj_mem_new(L, (GCSize)((n)*sizeof(t))))
@@ -173,5 +269,7 @@ static LJ_AINLINE void lj_mem_free(global_State *g, void *p, size_t osize)
 #define lj_mem_freet(g, p)	lj_mem_free(g, (p), sizeof(*(p)))
 
 LJ_FUNC void lj_gc_changemode(lua_State *L, int newmode);
+LJ_FUNC void lj_gc_addyoungstr(lua_State *L, GCstr *s);
+LJ_FUNC void lj_gc_addyounguv(lua_State *L);
 
 #endif
@@ -0,0 +1,328 @@
+/*
+** Background thread for the garbage collector.
+** Copyright (C) 2005-2017 Mike Pall. See Copyright Notice in luajit.h
+**
+** The allocator of a VM with a running GC thread is wrapped. Frees are
+** queued and handed to the helper thread, which returns the memory to
+** the wrapped allocator concurrently. So the sweep phase only pays for
+** unlinking dead objects, not for the allocator. All other calls to the
+** wrapped allocator are serialized with the helper thread by a mutex.
+**
+** A pool of workers is kept for the parallel mark phase of full
+** collections. The workers sleep between jobs, so lj_gcthread_run does
+** not pay for creating threads.
+*/
+
+#define lj_gcthread_c
+#define LUA_CORE
+
+#include "lj_obj.h"
+
+#if LJ_HASGCTHREAD
+
+#include <pthread.h>
+#include <sched.h>
+
+#include "lj_gc.h"
+#include "lj_gcthread.h"
+
+/* Frees staged by the VM thread before they are queued. */
+#define GCTHREAD_STAGE	128
+/* Frees queued for the helper thread. Must be a power of 2. */
+#define GCTHREAD_QUEUE	4096
+
+/* A deferred free. */
+typedef struct GCFreeItem {
+  void *p;			/* Block to free. */
+  size_t osize;			/* Size of block. */
+} GCFreeItem;
+
+/* GC thread state. */
+typedef struct GCThreadState {
+  lua_Alloc allocf;		/* Wrapped allocator. */
+  void *allocd;			/* Wrapped allocator data. */
+  pthread_mutex_t alock;	/* Serializes calls to the wrapped allocator. */
+  pthread_mutex_t qlock;	/* Protects the queue and the stop flag. */
+  pthread_cond_t qcond;		/* Signals queued frees or a stop request. */
+  pthread_t thread;		/* Helper thread. */
+  int stop;			/* Stop the helper thread. */
+  MSize qhead;			/* First queued free. */
+  MSize qnum;			/* Number of queued frees. */
+  MSize nstage;			/* Number of staged frees. */
+  GCFreeItem stage[GCTHREAD_STAGE];  /* Only accessed by the VM thread. */
+  GCFreeItem queue[GCTHREAD_QUEUE];  /* Ring buffer. */
+} GCThreadState;
+
+/* Free a list of blocks with the wrapped allocator. */
+static void gcthread_free(GCThreadState *gt, GCFreeItem *item, MSize n)
+{
+  MSize i;
+  pthread_mutex_lock(&gt->alock);
+  for (i = 0; i < n; i++)
+    gt->allocf(gt->allocd, item[i].p, item[i].osize, 0);
+  pthread_mutex_unlock(&gt->alock);
+}
+
+/* Queue the staged frees. Frees the rest directly if the queue is full. */
+static void gcthread_queue(GCThreadState *gt)
+{
+  MSize i, n = gt->nstage;
+  pthread_mutex_lock(&gt->qlock);
+  for (i = 0; i < n && gt->qnum < GCTHREAD_QUEUE; i++, gt->qnum++)
+    gt->queue[(gt->qhead + gt->qnum) & (GCTHREAD_QUEUE-1)] = gt->stage[i];
+  pthread_cond_signal(&gt->qcond);
+  pthread_mutex_unlock(&gt->qlock);
+  if (i < n)
+    gcthread_free(gt, &gt->stage[i], n - i);
+  gt->nstage = 0;
+}
+
+/* Helper thread. Exits after draining the queue on a stop request. */
+static void *gcthread_main(void *arg)
+{
+  GCThreadState *gt = (GCThreadState *)arg;
+  GCFreeItem item[GCTHREAD_STAGE];
+  for (;;) {
+    MSize n = 0;
+    pthread_mutex_lock(&gt->qlock);
+    while (gt->qnum == 0 && !gt->stop)
+      pthread_cond_wait(&gt->qcond, &gt->qlock);
+    for (; n < GCTHREAD_STAGE && gt->qnum > 0; n++, gt->qnum--) {
+      item[n] = gt->queue[gt->qhead];
+      gt->qhead = (gt->qhead + 1) & (GCTHREAD_QUEUE-1);
+    }
+    pthread_mutex_unlock(&gt->qlock);
+    if (n == 0)
+      break;
+    gcthread_free(gt, item, n);
+  }
+  return NULL;
+}
+
+/* Allocator wrapper. Called only by the VM thread. */
+void *lj_gcthread_alloc(void *ud, void *p, size_t osize, size_t nsize)
+{
+  GCThreadState *gt = (GCThreadState *)ud;
+  void *np;
+  if (nsize == 0 && p != NULL) {  /* Defer the free. */
+    GCFreeItem *item = &gt->stage[gt->nstage++];
+    item->p = p;
+    item->osize = osize;
+    if (gt->nstage == GCTHREAD_STAGE)
+      gcthread_queue(gt);
+    return NULL;
+  }
+  pthread_mutex_lock(&gt->alock);
+  np = gt->allocf(gt->allocd, p, osize, nsize);
+  pthread_mutex_unlock(&gt->alock);
+  return np;
+}
+
+/* Hand all staged frees to the helper thread, e.g. after a GC step. */
+void lj_gcthread_flush(global_State *g)
+{
+  if (lj_gcthread_active(g)) {
+    GCThreadState *gt = (GCThreadState *)g->allocd;
+    if (gt->nstage)
+      gcthread_queue(gt);
+  }
+}
+
+/*
+** Get the wrapped allocator. Only for internal use under lj_gcthread_lock.
+** lua_getallocf hands out the locking wrapper instead.
+*/
+lua_Alloc lj_gcthread_getallocf(global_State *g, void **ud)
+{
+  GCThreadState *gt = (GCThreadState *)g->allocd;
+  lua_assert(lj_gcthread_active(g));
+  if (ud) *ud = gt->allocd;
+  return gt->allocf;
+}
+
+/* Serialize direct accesses to the wrapped allocator, e.g. for stats. */
+void lj_gcthread_lock(global_State *g)
+{
+  lua_assert(lj_gcthread_active(g));
+  pthread_mutex_lock(&((GCThreadState *)g->allocd)->alock);
+}
+
+void lj_gcthread_unlock(global_State *g)
+{
+  lua_assert(lj_gcthread_active(g));
+  pthread_mutex_unlock(&((GCThreadState *)g->allocd)->alock);
+}
+
+/* Pool of worker threads, e.g. for the parallel mark phase. */
+struct GCThreadPool {
+  pthread_mutex_t lock;		/* Protects the job and the stop flag. */
+  pthread_cond_t wake;		/* Signals a new job or a stop request. */
+  pthread_cond_t done;		/* Signals the end of a job. */
+  GCThreadFunc f;		/* Worker function of the current job. */
+  void *ud;			/* Worker data of the current job. */
+  uint32_t job;			/* Number of the current job. */
+  int busy;			/* Workers still running the current job. */
+  int stop;			/* Stop the workers. */
+  int n;			/* Number of workers. */
+  pthread_t thread[LJ_GC_MAXMARKERS];  /* Workers. */
+  struct GCThreadWorker {
+    GCThreadPool *pool;		/* Pool of the worker. */
+    int id;			/* Worker id. */
+  } worker[LJ_GC_MAXMARKERS];
+};
+
+/* Worker main loop. Sleeps until the next job or a stop request. */
+static void *gcthread_poolmain(void *arg)
+{
+  struct GCThreadWorker *w = (struct GCThreadWorker *)arg;
+  GCThreadPool *pool = w->pool;
+  uint32_t job = 0;
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (!pool->stop && pool->job == job)
+      pthread_cond_wait(&pool->wake, &pool->lock);
+    if (pool->stop)
+      break;
+    job = pool->job;
+    pthread_mutex_unlock(&pool->lock);
+    pool->f(pool->ud, w->id);
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->busy == 0)
+      pthread_cond_signal(&pool->done);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+/*
+** Start a pool of up to n workers. Workers that fail to start are
+** skipped, so the jobs must not rely on a particular number of workers.
+** Returns NULL if no worker could be started.
+*/
+GCThreadPool *lj_gcthread_poolstart(global_State *g, int n)
+{
+  GCThreadPool *pool;
+  int i;
+  lua_assert(n > 0 && n <= LJ_GC_MAXMARKERS);
+  pool = (GCThreadPool *)g->allocf(g->allocd, NULL, 0, sizeof(GCThreadPool));
+  if (pool == NULL)
+    return NULL;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+  pthread_cond_init(&pool->done, NULL);
+  pool->job = 0;
+  pool->busy = 0;
+  pool->stop = 0;
+  pool->n = 0;
+  for (i = 0; i < n; i++) {
+    struct GCThreadWorker *w = &pool->worker[pool->n];
+    w->pool = pool;
+    w->id = pool->n+1;
+    if (pthread_create(&pool->thread[pool->n], NULL, gcthread_poolmain, w) == 0)
+      pool->n++;
+  }
+  if (pool->n == 0) {
+    lj_gcthread_poolstop(g, pool);
+    return NULL;
+  }
+  return pool;
+}
+
+/* Stop and free a pool. Must not be called while a job runs. */
+void lj_gcthread_poolstop(global_State *g, GCThreadPool *pool)
+{
+  int i;
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = 1;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+  for (i = 0; i < pool->n; i++)
+    pthread_join(pool->thread[i], NULL);
+  pthread_cond_destroy(&pool->done);
+  pthread_cond_destroy(&pool->wake);
+  pthread_mutex_destroy(&pool->lock);
+  g->allocf(g->allocd, pool, sizeof(GCThreadPool), 0);
+}
+
+/* Number of workers in a pool. */
+int lj_gcthread_poolsize(GCThreadPool *pool)
+{
+  return pool->n;
+}
+
+/*
+** Run f(ud, 1..n) on the n workers of a pool and f(ud, 0) on the calling
+** thread. Returns after all of them are done.
+*/
+void lj_gcthread_run(GCThreadPool *pool, GCThreadFunc f, void *ud)
+{
+  pthread_mutex_lock(&pool->lock);
+  lua_assert(pool->busy == 0);
+  pool->f = f;
+  pool->ud = ud;
+  pool->busy = pool->n;
+  pool->job++;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+  f(ud, 0);
+  pthread_mutex_lock(&pool->lock);
+  while (pool->busy)
+    pthread_cond_wait(&pool->done, &pool->lock);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+/* Give up the CPU while waiting for other workers. */
+void lj_gcthread_yield(void)
+{
+  sched_yield();
+}
+
+/* Start the GC thread. Returns 0 on failure. */
+int lj_gcthread_start(global_State *g)
+{
+  GCThreadState *gt;
+  if (lj_gcthread_active(g))
+    return 1;
+  gt = (GCThreadState *)g->allocf(g->allocd, NULL, 0, sizeof(GCThreadState));
+  if (gt == NULL)
+    return 0;
+  gt->allocf = g->allocf;
+  gt->allocd = g->allocd;
+  gt->stop = 0;
+  gt->qhead = gt->qnum = gt->nstage = 0;
+  pthread_mutex_init(&gt->alock, NULL);
+  pthread_mutex_init(&gt->qlock, NULL);
+  pthread_cond_init(&gt->qcond, NULL);
+  if (pthread_create(&gt->thread, NULL, gcthread_main, gt) != 0) {
+    pthread_cond_destroy(&gt->qcond);
+    pthread_mutex_destroy(&gt->qlock);
+    pthread_mutex_destroy(&gt->alock);
+    g->allocf(g->allocd, gt, sizeof(GCThreadState), 0);
+    return 0;
+  }
+  g->allocf = lj_gcthread_alloc;
+  g->allocd = gt;
+  return 1;
+}
+
+/* Stop the GC thread after all deferred frees are done. */
+void lj_gcthread_stop(global_State *g)
+{
+  if (lj_gcthread_active(g)) {
+    GCThreadState *gt = (GCThreadState *)g->allocd;
+    lj_gcthread_flush(g);
+    pthread_mutex_lock(&gt->qlock);
+    gt->stop = 1;
+    pthread_cond_signal(&gt->qcond);
+    pthread_mutex_unlock(&gt->qlock);
+    pthread_join(gt->thread, NULL);
+    pthread_cond_destroy(&gt->qcond);
+    pthread_mutex_destroy(&gt->qlock);
+    pthread_mutex_destroy(&gt->alock);
+    g->allocf = gt->allocf;
+    g->allocd = gt->allocd;
+    g->allocf(g->allocd, gt, sizeof(GCThreadState), 0);
+  }
+}
+
+#endif
@@ -0,0 +1,36 @@
+/*
+** Background thread for the garbage collector.
+** Copyright (C) 2005-2017 Mike Pall. See Copyright Notice in luajit.h
+*/
+
+#ifndef _LJ_GCTHREAD_H
+#define _LJ_GCTHREAD_H
+
+#include "lj_obj.h"
+
+#if LJ_HASGCTHREAD
+
+LJ_FUNC int lj_gcthread_start(global_State *g);
+LJ_FUNC void lj_gcthread_stop(global_State *g);
+LJ_FUNC void lj_gcthread_flush(global_State *g);
+LJ_FUNC lua_Alloc lj_gcthread_getallocf(global_State *g, void **ud);
+LJ_FUNC void lj_gcthread_lock(global_State *g);
+LJ_FUNC void lj_gcthread_unlock(global_State *g);
+LJ_FUNC void *lj_gcthread_alloc(void *ud, void *p, size_t osize, size_t nsize);
+
+/* Worker function for lj_gcthread_run. The VM thread has id 0. */
+typedef void (*GCThreadFunc)(void *ud, int id);
+
+typedef struct GCThreadPool GCThreadPool;
+
+LJ_FUNC GCThreadPool *lj_gcthread_poolstart(global_State *g, int n);
+LJ_FUNC void lj_gcthread_poolstop(global_State *g, GCThreadPool *pool);
+LJ_FUNC int lj_gcthread_poolsize(GCThreadPool *pool);
+LJ_FUNC void lj_gcthread_run(GCThreadPool *pool, GCThreadFunc f, void *ud);
+LJ_FUNC void lj_gcthread_yield(void);
+
+#define lj_gcthread_active(g)	((g)->allocf == lj_gcthread_alloc)
+
+#endif
+
+#endif
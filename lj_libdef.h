@@ -142,10 +142,11 @@ static const lua_CFunction lj_lib_cf_table[] = {
   lj_cf_table_maxn,
   lj_cf_table_insert,
   lj_cf_table_concat,
-  lj_cf_table_sort
+  lj_cf_table_sort,
+  lj_cf_table_freeze
 };
 static const uint8_t lj_lib_init_table[] = {
-90,57,9,249,8,102,111,114,101,97,99,104,105,0,2,10,0,0,0,15,16,0,12,0,16,1,
+90,57,10,249,8,102,111,114,101,97,99,104,105,0,2,10,0,0,0,15,16,0,12,0,16,1,
 9,0,41,2,1,0,21,3,0,0,41,4,1,0,77,2,8,128,18,6,1,0,18,8,5,0,59,9,5,0,66,6,3,
 2,10,6,0,0,88,7,1,128,76,6,2,0,79,2,248,127,75,0,1,0,249,7,102,111,114,101,
 97,99,104,0,2,11,0,0,0,16,16,0,12,0,16,1,9,0,43,2,0,0,18,3,0,0,41,4,0,0,88,
@@ -161,8 +162,8 @@ static const uint8_t lj_lib_init_table[] = {
 128,33,5,1,3,0,2,3,0,88,6,4,128,2,3,1,0,88,6,2,128,4,4,0,0,88,6,9,128,18,6,
 1,0,18,7,2,0,41,8,1,0,77,6,4,128,32,10,5,9,59,11,9,0,64,11,10,4,79,6,252,127,
 88,6,8,128,18,6,2,0,18,7,1,0,41,8,255,255,77,6,4,128,32,10,5,9,59,11,9,0,64,
-11,10,4,79,6,252,127,76,4,2,0,6,99,111,110,99,97,116,4,115,111,114,116,254,
-254,255
+11,10,4,79,6,252,127,76,4,2,0,6,99,111,110,99,97,116,4,115,111,114,116,6,
+102,114,101,101,122,101,254,254,255
 };
 #endif
 
@@ -180,7 +181,7 @@ static const lua_CFunction lj_lib_cf_io_method[] = {
   lj_cf_io_method___tostring
 };
 static const uint8_t lj_lib_init_io_method[] = {
-96,57,10,5,99,108,111,115,101,4,114,101,97,100,5,119,114,105,116,101,5,102,
+97,57,10,5,99,108,111,115,101,4,114,101,97,100,5,119,114,105,116,101,5,102,
 108,117,115,104,4,115,101,101,107,7,115,101,116,118,98,117,102,5,108,105,110,
 101,115,4,95,95,103,99,10,95,95,116,111,115,116,114,105,110,103,252,1,199,95,
 95,105,110,100,101,120,250,255
@@ -203,7 +204,7 @@ static const lua_CFunction lj_lib_cf_io[] = {
   lj_cf_io_type
 };
 static const uint8_t lj_lib_init_io[] = {
-105,57,12,252,2,192,250,4,111,112,101,110,5,112,111,112,101,110,7,116,109,112,
+106,57,12,252,2,192,250,4,111,112,101,110,5,112,111,112,101,110,7,116,109,112,
 102,105,108,101,5,99,108,111,115,101,4,114,101,97,100,5,119,114,105,116,101,
 5,102,108,117,115,104,5,105,110,112,117,116,6,111,117,116,112,117,116,5,108,
 105,110,101,115,4,116,121,112,101,255
@@ -226,7 +227,7 @@ static const lua_CFunction lj_lib_cf_os[] = {
   lj_cf_os_setlocale
 };
 static const uint8_t lj_lib_init_os[] = {
-116,57,11,7,101,120,101,99,117,116,101,6,114,101,109,111,118,101,6,114,101,
+117,57,11,7,101,120,101,99,117,116,101,6,114,101,109,111,118,101,6,114,101,
 110,97,109,101,7,116,109,112,110,97,109,101,6,103,101,116,101,110,118,4,101,
 120,105,116,5,99,108,111,99,107,4,100,97,116,101,4,116,105,109,101,8,100,105,
 102,102,116,105,109,101,9,115,101,116,108,111,99,97,108,101,255
@@ -254,7 +255,7 @@ static const lua_CFunction lj_lib_cf_debug[] = {
   lj_cf_debug_traceback
 };
 static const uint8_t lj_lib_init_debug[] = {
-127,57,16,11,103,101,116,114,101,103,105,115,116,114,121,12,103,101,116,109,
+128,57,16,11,103,101,116,114,101,103,105,115,116,114,121,12,103,101,116,109,
 101,116,97,116,97,98,108,101,12,115,101,116,109,101,116,97,116,97,98,108,101,
 7,103,101,116,102,101,110,118,7,115,101,116,102,101,110,118,7,103,101,116,105,
 110,102,111,8,103,101,116,108,111,99,97,108,8,115,101,116,108,111,99,97,108,
@@ -275,7 +276,7 @@ static const lua_CFunction lj_lib_cf_jit[] = {
   lj_cf_jit_attach
 };
 static const uint8_t lj_lib_init_jit[] = {
-143,57,9,2,111,110,3,111,102,102,5,102,108,117,115,104,6,115,116,97,116,117,
+144,57,9,2,111,110,3,111,102,102,5,102,108,117,115,104,6,115,116,97,116,117,
 115,6,97,116,116,97,99,104,252,5,194,111,115,250,252,4,196,97,114,99,104,250,
 252,3,203,118,101,114,115,105,111,110,95,110,117,109,250,252,2,199,118,101,
 114,115,105,111,110,250,255
@@ -295,14 +296,16 @@ static const lua_CFunction lj_lib_cf_jit_util[] = {
   lj_cf_jit_util_tracesnap,
   lj_cf_jit_util_tracemc,
   lj_cf_jit_util_traceexitstub,
-  lj_cf_jit_util_ircalladdr
+  lj_cf_jit_util_ircalladdr,
+  lj_cf_jit_util_tabinfo
 };
 static const uint8_t lj_lib_init_jit_util[] = {
-148,57,11,8,102,117,110,99,105,110,102,111,6,102,117,110,99,98,99,5,102,117,
+149,57,12,8,102,117,110,99,105,110,102,111,6,102,117,110,99,98,99,5,102,117,
 110,99,107,10,102,117,110,99,117,118,110,97,109,101,9,116,114,97,99,101,105,
 110,102,111,7,116,114,97,99,101,105,114,6,116,114,97,99,101,107,9,116,114,97,
 99,101,115,110,97,112,7,116,114,97,99,101,109,99,13,116,114,97,99,101,101,120,
-105,116,115,116,117,98,10,105,114,99,97,108,108,97,100,100,114,255
+105,116,115,116,117,98,10,105,114,99,97,108,108,97,100,100,114,7,116,97,98,
+105,110,102,111,255
 };
 #endif
 
@@ -312,7 +315,7 @@ static const lua_CFunction lj_lib_cf_jit_opt[] = {
   lj_cf_jit_opt_start
 };
 static const uint8_t lj_lib_init_jit_opt[] = {
-159,57,1,5,115,116,97,114,116,255
+161,57,1,5,115,116,97,114,116,255
 };
 #endif
 
@@ -321,11 +324,15 @@ static const uint8_t lj_lib_init_jit_opt[] = {
 static const lua_CFunction lj_lib_cf_jit_profile[] = {
   lj_cf_jit_profile_start,
   lj_cf_jit_profile_stop,
-  lj_cf_jit_profile_dumpstack
+  lj_cf_jit_profile_dumpstack,
+  lj_cf_jit_profile_folded,
+  lj_cf_jit_profile_alloc,
+  lj_cf_jit_profile_allocfolded
 };
 static const uint8_t lj_lib_init_jit_profile[] = {
-160,57,3,5,115,116,97,114,116,4,115,116,111,112,9,100,117,109,112,115,116,97,
-99,107,255
+162,57,6,5,115,116,97,114,116,4,115,116,111,112,9,100,117,109,112,115,116,97,
+99,107,6,102,111,108,100,101,100,5,97,108,108,111,99,11,97,108,108,111,99,102,
+111,108,100,101,100,255
 };
 #endif
 
@@ -352,7 +359,7 @@ static const lua_CFunction lj_lib_cf_ffi_meta[] = {
   lj_cf_ffi_meta___ipairs
 };
 static const uint8_t lj_lib_init_ffi_meta[] = {
-163,57,19,7,95,95,105,110,100,101,120,10,95,95,110,101,119,105,110,100,101,
+168,57,19,7,95,95,105,110,100,101,120,10,95,95,110,101,119,105,110,100,101,
 120,4,95,95,101,113,5,95,95,108,101,110,4,95,95,108,116,4,95,95,108,101,8,95,
 95,99,111,110,99,97,116,6,95,95,99,97,108,108,5,95,95,97,100,100,5,95,95,115,
 117,98,5,95,95,109,117,108,5,95,95,100,105,118,5,95,95,109,111,100,5,95,95,
@@ -370,7 +377,7 @@ static const lua_CFunction lj_lib_cf_ffi_clib[] = {
   lj_cf_ffi_clib___gc
 };
 static const uint8_t lj_lib_init_ffi_clib[] = {
-181,57,3,7,95,95,105,110,100,101,120,10,95,95,110,101,119,105,110,100,101,120,
+186,57,3,7,95,95,105,110,100,101,120,10,95,95,110,101,119,105,110,100,101,120,
 4,95,95,103,99,255
 };
 #endif
@@ -382,7 +389,7 @@ static const lua_CFunction lj_lib_cf_ffi_callback[] = {
   lj_cf_ffi_callback_set
 };
 static const uint8_t lj_lib_init_ffi_callback[] = {
-184,57,3,4,102,114,101,101,3,115,101,116,252,1,199,95,95,105,110,100,101,120,
+189,57,3,4,102,114,101,101,3,115,101,116,252,1,199,95,95,105,110,100,101,120,
 250,255
 };
 #endif
@@ -409,7 +416,7 @@ static const lua_CFunction lj_lib_cf_ffi[] = {
   lj_cf_ffi_load
 };
 static const uint8_t lj_lib_init_ffi[] = {
-186,57,23,4,99,100,101,102,3,110,101,119,4,99,97,115,116,6,116,121,112,101,
+191,57,23,4,99,100,101,102,3,110,101,119,4,99,97,115,116,6,116,121,112,101,
 111,102,8,116,121,112,101,105,110,102,111,6,105,115,116,121,112,101,6,115,105,
 122,101,111,102,7,97,108,105,103,110,111,102,8,111,102,102,115,101,116,111,
 102,5,101,114,114,110,111,6,115,116,114,105,110,103,4,99,111,112,121,4,102,
@@ -168,10 +168,14 @@ TValue *lj_meta_tset(lua_State *L, cTValue *o, cTValue *k)
       GCtab *t = tabV(o);
       cTValue *tv = lj_tab_get(L, t, k);
       if (LJ_LIKELY(!tvisnil(tv))) {
+	if (LJ_UNLIKELY(tabisfrozen(t)))
+	  lj_err_msg(L, LJ_ERR_TABRO);
 	t->nomm = 0;  /* Invalidate negative metamethod cache. */
 	lj_gc_anybarriert(L, t);
 	return (TValue *)tv;
       } else if (!(mo = lj_meta_fast(L, tabref(t->metatable), MM_newindex))) {
+	if (LJ_UNLIKELY(tabisfrozen(t)))
+	  lj_err_msg(L, LJ_ERR_TABRO);
 	t->nomm = 0;  /* Invalidate negative metamethod cache. */
 	lj_gc_anybarriert(L, t);
 	if (tv != niltv(L))
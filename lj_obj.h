@@ -495,6 +495,7 @@ typedef struct GCtab {
 } GCtab;
 
 #define sizetabcolo(n)	((n)*sizeof(TValue) + sizeof(GCtab))
+#define tabisfrozen(t)	((t)->marked & 0x80)
 #define tabref(r)	(&gcref((r))->tab)
 #define noderef(r)	(mref((r), Node))
 #define nextnode(n)	(mref((n)->next, Node))
@@ -573,6 +574,7 @@ typedef enum {
 /* kinds of Garbage Collection */
 #define KGC_INC		0	/* incremental gc */
 #define KGC_GEN		1	/* generational gc */
+#define KGC_GENMAJOR	2	/* generational gc doing an incremental major cycle */
 
 typedef struct GCState {
   GCSize total;		/* Memory currently allocated. */
@@ -580,7 +582,7 @@ typedef struct GCState {
   uint8_t currentwhite;	/* Current white color. */
   uint8_t state;	/* GC state. */
   uint8_t nocdatafin;	/* No cdata finalizer called. */
-  uint8_t unused2;
+  uint8_t youngmark;	/* Young collection is in its mark phase. */
   MSize sweepstr;	/* Sweep position in string table. */
   GCRef root;		/* List of all collectable objects. */
   MRef sweep;		/* Sweep position in root list. */
@@ -595,14 +597,90 @@ typedef struct GCState {
   uint8_t kind;   // gc类型，分代还是分步？
   uint8_t genminormul;  // 分代模式young gc参数;
   uint8_t genmajormul;  // 分代模式full gc参数;
+  uint8_t genbadmul;	/* Minor survival % that falls back to incremental. */
+  uint8_t genstablemul;	/* Live heap growth % that returns to generational. */
+  uint8_t genbad;	/* Incremental after a bad minor collection. */
+  uint8_t genlost;	/* A generational index could not be grown. */
+  uint8_t nmarkers;	/* Helper threads for marking in full collections. */
+  uint8_t fullmark;	/* Full collection in progress. */
+  uint8_t autotrim;	/* Trim the allocator after full collections. */
+  uint8_t allocsample;	/* Allocation sampler is running. */
   GCRef surival;  // 当前gc存活的对象链表开始位置;
   GCRef old;    // 上一轮存活下来的对象链表开始位置;
   GCRef reallyold; // 标记为old的对象链表开始位置;
   GCRef udatasur;  // 当前存活的userdata对象链表开始位置;
   GCRef udataold;  // 上一轮存活的userdata对象链表开始位置;
   GCRef udatarold; // 标记为old的userdata对象链表开始位置;
+  MRef youngstr;	/* Strings not yet old in generational mode. */
+  MSize youngstrnum;	/* Number of entries in youngstr. */
+  MSize sizeyoungstr;	/* Size of youngstr vector. */
+  MRef remset;		/* Remembered set: touched old tables. */
+  MRef remsettop;	/* Next free slot in remset. */
+  MRef remsetlim;	/* End of remset vector. */
+  MRef old1;		/* Objects aged G_OLD1 by the last young collection. */
+  MSize old1num;	/* Number of entries in old1. */
+  MSize sizeold1;	/* Size of old1 vector. */
+  MRef uvthreads;	/* Threads with open upvalues not yet old. */
+  MSize uvthreadnum;	/* Number of entries in uvthreads. */
+  MSize sizeuvthreads;	/* Size of uvthreads vector. */
+  MRef markstate;	/* State of the parallel marker or NULL. */
+  MRef nursery;		/* Nursery for young objects or NULL. */
+  MSize genstepmul;	/* Generational GC step granularity (0: atomic). */
+  GCSize minorbase;	/* Memory in use after the last minor collection. */
+  GCSize lastestimate;	/* Live memory of the last cycle while genbad. */
+  GCSize allocleft;	/* Bytes until the next allocation sample. */
 } GCState;
 
+/* GC phases for the telemetry in GCStats. */
+#define GCPHASEDEF(_) \
+  _(markold) _(propagate) _(atomic) _(sweepstring) _(sweep) _(sweepgen) \
+  _(finishgen) _(finalize)
+
+typedef enum {
+#define GCPHASEENUM(name)	GCPHASE_##name,
+GCPHASEDEF(GCPHASEENUM)
+#undef GCPHASEENUM
+  GCPHASE__MAX
+} GCPhase;
+
+/* Kinds of collection cycles, see lj_gc_step. */
+#define GCCYCLEDEF(_) \
+  _(inc) _(young) _(major) _(full)
+
+typedef enum {
+#define GCCYCLEENUM(name)	GCCYCLE_##name,
+GCCYCLEDEF(GCCYCLEENUM)
+#undef GCCYCLEENUM
+  GCCYCLE__MAX
+} GCCycle;
+
+#define GC_PAUSEHIST	24	/* Buckets of the pause histogram. */
+
+typedef struct GCPhaseStats {
+  uint64_t ns;		/* Time spent in the phase. */
+  uint64_t num;		/* Number of timed intervals. */
+  uint64_t maxns;	/* Longest interval. */
+} GCPhaseStats;
+
+/* GC telemetry. Kept in GG_State, away from the offsets used by the VM. */
+typedef struct GCStats {
+  uint64_t tpause;	/* Start of the current pause. */
+  uint64_t tphase;	/* Start of the current phase. */
+  int32_t phase;	/* Current phase or -1. */
+  int32_t depth;	/* Nesting depth of pauses. 0: no pause running. */
+  int32_t cycle;	/* Kind of the running cycle. */
+  uint64_t minor;	/* Number of young collections. */
+  uint64_t major;	/* Number of full marks (incremental or major). */
+  uint64_t pauses;	/* Number of pauses (steps and full collections). */
+  uint64_t freedyoung;	/* Bytes freed by young collections. */
+  uint64_t freedold;	/* Bytes freed by the sweep of full cycles. */
+  uint64_t promoted;	/* Bytes surviving young collections. */
+  uint64_t pausens;	/* Total pause time. */
+  uint64_t maxpausens;	/* Longest pause. */
+  uint64_t pausehist[GC_PAUSEHIST];  /* Pauses below 2^(10+i) ns. */
+  GCPhaseStats phases[GCPHASE__MAX];  /* Time spent per phase. */
+} GCStats;
+
 /* Global state, shared by all threads of a Lua universe. */
 typedef struct global_State {
   GCRef *strhash;	/* String hash table (hash chain anchors). */
@@ -663,6 +741,7 @@ struct lua_State {
   GCHeader;
   uint8_t dummy_ffid;	/* Fake FF_C for curr_funcisL() on dummy frames. */
   uint8_t status;	/* Thread status. */
+  uint8_t younguv;	/* Thread is in gc.uvthreads. */
   MRef glref;		/* Link to global state. */
   GCRef gclist;		/* GC chain. */
   TValue *base;		/* Base of currently executing function. */
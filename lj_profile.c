@@ -6,13 +6,20 @@
 #define lj_profile_c
 #define LUA_CORE
 
+/* To get the sigevent thread id. Must be defined before any system includes. */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #include "lj_obj.h"
 
 #if LJ_HASPROFILE
 
+#include "lj_gc.h"
 #include "lj_buf.h"
 #include "lj_frame.h"
 #include "lj_debug.h"
+#include "lj_strfmt.h"
 #include "lj_dispatch.h"
 #if LJ_HASJIT
 #include "lj_jit.h"
@@ -22,6 +29,8 @@
 
 #include "luajit.h"
 
+#include <math.h>
+
 #if LJ_PROFILE_SIGPROF
 
 #include <sys/time.h>
@@ -29,15 +38,31 @@
 #define profile_lock(ps)	UNUSED(ps)
 #define profile_unlock(ps)	UNUSED(ps)
 
+#if LJ_TARGET_LINUX && defined(SIGEV_THREAD_ID)
+/* Per-thread CPU-time timers. Each VM can be profiled independently. */
+#define LJ_PROFILE_THREADTIMER	1
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id	_sigev_un._tid
+#endif
+#endif
+
 #elif LJ_PROFILE_PTHREAD
 
 #include <pthread.h>
 #include <time.h>
+#include <unistd.h>
 #if LJ_TARGET_PS3
 #include <sys/timer.h>
 #endif
 #define profile_lock(ps)	pthread_mutex_lock(&ps->lock)
 #define profile_unlock(ps)	pthread_mutex_unlock(&ps->lock)
+#if !LJ_TARGET_PS3 && defined(_POSIX_THREAD_CPUTIME) && _POSIX_THREAD_CPUTIME >= 0
+/* CPU-time sampling by polling the clock of the profiled thread. */
+#define LJ_PROFILE_CPUCLOCK	1
+#endif
 
 #elif LJ_PROFILE_WTHREAD
 
@@ -54,21 +79,115 @@ typedef unsigned int (WINAPI *WMM_TPFUNC)(unsigned int);
 
 #endif
 
-/* Profiler state. */
+/* Native aggregation of samples, see profile_record. */
+#define LJ_PROFILE_MAXDEPTH	32	/* Max. recorded frames per sample. */
+#define LJ_PROFILE_NSTACK	4096	/* Max. stacks. Must be a power of 2. */
+#define LJ_PROFILE_NLOC		2048	/* Max. locations. Must be a power of 2. */
+#define LJ_PROFILE_NAMESIZE	(LUA_IDSIZE+12)
+
+/* Interned frame location. Its name is formatted only once. */
+typedef struct ProfileLoc {
+  const void *key;		/* Prototype, C function or fast function id. */
+  const void *chunk;		/* Chunk name. Guards against reused keys. */
+  BCLine line;			/* Current line or a negative tag. */
+  char name[LJ_PROFILE_NAMESIZE];  /* Name in the folded stacks. */
+} ProfileLoc;
+
+/* Aggregated samples of one stack. */
+typedef struct ProfileStack {
+  uint32_t hash;		/* Hash of the stack. 0: free slot. */
+  uint32_t count;		/* Number of samples. */
+  int32_t trace;		/* Trace number of 'N' samples or 0. */
+  int16_t gcstate;		/* GC cycle and phase of 'G' samples or -1. */
+  uint8_t vmstate;		/* VM state, see profile_trigger. */
+  uint8_t depth;		/* Number of frames. */
+  uint16_t loc[LJ_PROFILE_MAXDEPTH];  /* Locations, innermost first. */
+} ProfileStack;
+
+/* Interned locations. Open addressing. */
+typedef struct ProfileLocs {
+  MSize nloc;			/* Number of used locations. */
+  ProfileLoc loc[LJ_PROFILE_NLOC];  /* loc[0] is for unknown locations. */
+} ProfileLocs;
+
+/* Preallocated tables for native aggregation. Open addressing. */
+typedef struct ProfileAgg {
+  ProfileLocs locs;		/* Locations of all stacks. */
+  MSize nstack;			/* Number of used stacks. */
+  MSize lost;			/* Samples lost to full tables. */
+  ProfileStack stack[LJ_PROFILE_NSTACK];
+} ProfileAgg;
+
+/* Allocation sampling, see lj_profile_allocsample. */
+#define LJ_PROFILE_NSITE	4096	/* Max. sites. Must be a power of 2. */
+#define LJ_PROFILE_NTRACK	4096	/* Tracked objects. Must be a power of 2. */
+#define LJ_PROFILE_ALLOCMEM	0xff	/* Type of allocations without object. */
+
+/* Allocation site: a stack plus the type of the allocated object. */
+typedef struct ProfileSite {
+  uint32_t hash;		/* Hash of the site. 0: free slot. */
+  int32_t trace;		/* Trace number of allocations on trace or 0. */
+  uint8_t gct;			/* Object type or LJ_PROFILE_ALLOCMEM. */
+  uint8_t depth;		/* Number of frames. */
+  uint16_t loc[LJ_PROFILE_MAXDEPTH];  /* Locations, innermost first. */
+  double count;			/* Estimated number of allocations. */
+  double bytes;			/* Estimated number of bytes. */
+  double oldbytes;		/* Estimated bytes surviving to G_OLD. */
+} ProfileSite;
+
+/* Sampled object, tracked until it gets old or dies. Direct-mapped. */
+typedef struct ProfileTracked {
+  GCobj *o;			/* Object or NULL. */
+  uint32_t site;		/* Index of the site. */
+  double bytes;			/* Estimated bytes represented by the sample. */
+} ProfileTracked;
+
+/* Preallocated tables for allocation sampling. */
+typedef struct ProfileAlloc {
+  ProfileLocs locs;		/* Locations of all sites. */
+  MSize nsite;			/* Number of used sites. */
+  uint32_t rate;		/* Mean sample interval in bytes. */
+  int trackold;			/* Track survival of sampled objects. */
+  uint64_t seed;		/* PRNG state for the sample intervals. */
+  double lost;			/* Estimated bytes lost to full tables. */
+  /* A new object has no type yet. Its sample is pending until it's known. */
+  GCobj *pending;		/* Object of the pending sample or NULL. */
+  double pbytes;		/* Estimated bytes of the pending sample. */
+  double pcount;		/* Estimated count of the pending sample. */
+  int32_t ptrace;		/* Trace number of the pending sample. */
+  uint8_t pdepth;		/* Number of frames of the pending sample. */
+  uint16_t ploc[LJ_PROFILE_MAXDEPTH];  /* Frames of the pending sample. */
+  ProfileSite site[LJ_PROFILE_NSITE];
+  ProfileTracked tracked[LJ_PROFILE_NTRACK];
+} ProfileAlloc;
+
+/* Profiler state. One per VM, see profile_getstate. */
 typedef struct ProfileState {
-  global_State *g;		/* VM state that started the profiler. */
+  global_State *g;		/* VM state or NULL if the profiler is off. */
   luaJIT_profile_callback cb;	/* Profiler callback. */
   void *data;			/* Profiler callback data. */
   SBuf sb;			/* String buffer for stack dumps. */
   int interval;			/* Sample interval in milliseconds. */
   int samples;			/* Number of samples for next callback. */
   int vmstate;			/* VM state when profile timer triggered. */
-#if LJ_PROFILE_SIGPROF
+  int trace;			/* Trace number when profile timer triggered. */
+  int gcstate;			/* GC cycle and phase, see profile_gcstate. */
+  ProfileAgg *agg;		/* Aggregated samples or NULL. */
+  int native;			/* Aggregate natively instead of a callback. */
+  ProfileAlloc *alloc;		/* Allocation samples or NULL. */
+  int clock;			/* Sample clock: 'c' CPU time, 'w' wall time. */
+#if LJ_PROFILE_THREADTIMER
+  timer_t timer;		/* Timer of the thread that started profiling. */
+  int hastimer;			/* Timer was created. */
+#elif LJ_PROFILE_SIGPROF
   struct sigaction oldsa;	/* Previous SIGPROF state. */
 #elif LJ_PROFILE_PTHREAD
   pthread_mutex_t lock;		/* g->hookmask update lock. */
   pthread_t thread;		/* Timer thread. */
   int abort;			/* Abort timer thread. */
+#if LJ_PROFILE_CPUCLOCK
+  clockid_t cpuclock;		/* CPU-time clock of the profiled thread. */
+#endif
 #elif LJ_PROFILE_WTHREAD
 #if LJ_TARGET_WINDOWS
   HINSTANCE wmm;		/* WinMM library handle. */
@@ -78,27 +197,54 @@ typedef struct ProfileState {
   CRITICAL_SECTION lock;	/* g->hookmask update lock. */
   HANDLE thread;		/* Timer thread. */
   int abort;			/* Abort timer thread. */
+#if LJ_TARGET_WINDOWS
+  HANDLE target;		/* Profiled thread, for its CPU time. */
+#endif
 #endif
 } ProfileState;
 
-/* Sadly, we have to use a static profiler state.
-**
-** The SIGPROF variant needs a static pointer to the global state, anyway.
-** And it would be hard to extend for multiple threads. You can still use
-** multiple VMs in multiple threads, but only profile one at a time.
+/* Each VM has its own profiler state, so many VMs in different threads can
+** be profiled at the same time. Only the SIGPROF variant without per-thread
+** timers is limited to a single profiled VM per process: it needs a static
+** pointer to the profiler state for the signal handler and the process-wide
+** interval timer can only drive one of them.
 */
-static ProfileState profile_state;
+#if LJ_PROFILE_SIGPROF && !LJ_PROFILE_THREADTIMER
+static ProfileState *profile_sigstate;
+#endif
 
 /* Default sample interval in milliseconds. */
 #define LJ_PROFILE_INTERVAL_DEFAULT	10
 
+/* Default sample clock. Signal timers count CPU time, timer threads don't. */
+#if LJ_PROFILE_SIGPROF
+#define LJ_PROFILE_CLOCK_DEFAULT	'c'
+#else
+#define LJ_PROFILE_CLOCK_DEFAULT	'w'
+#endif
+
+#define profile_state(g)	(G2GG(g)->prof)
+
+/* Get the profiler state of a VM. Creates it on demand. */
+static ProfileState *profile_getstate(lua_State *L)
+{
+  global_State *g = G(L);
+  ProfileState *ps = profile_state(g);
+  if (!ps) {
+    ps = lj_mem_newt(L, sizeof(ProfileState), ProfileState);
+    memset(ps, 0, sizeof(ProfileState));
+    profile_state(g) = ps;
+  }
+  return ps;
+}
+
 /* -- Profiler/hook interaction ------------------------------------------- */
 
 #if !LJ_PROFILE_SIGPROF
 void LJ_FASTCALL lj_profile_hook_enter(global_State *g)
 {
-  ProfileState *ps = &profile_state;
-  if (ps->g) {
+  ProfileState *ps = profile_state(g);
+  if (ps && ps->g) {
     profile_lock(ps);
     hook_enter(g);
     profile_unlock(ps);
@@ -109,8 +255,8 @@ void LJ_FASTCALL lj_profile_hook_enter(global_State *g)
 
 void LJ_FASTCALL lj_profile_hook_leave(global_State *g)
 {
-  ProfileState *ps = &profile_state;
-  if (ps->g) {
+  ProfileState *ps = profile_state(g);
+  if (ps && ps->g) {
     profile_lock(ps);
     hook_leave(g);
     profile_unlock(ps);
@@ -120,17 +266,304 @@ void LJ_FASTCALL lj_profile_hook_leave(global_State *g)
 }
 #endif
 
+/* -- Native aggregation ------------------------------------------------- */
+
+static const char *const profile_gccycle[] = {
+#define GCCYCLENAME(name)	#name,
+GCCYCLEDEF(GCCYCLENAME)
+#undef GCCYCLENAME
+};
+
+static const char *const profile_gcphase[] = {
+#define GCPHASENAME(name)	#name,
+GCPHASEDEF(GCPHASENAME)
+#undef GCPHASENAME
+};
+
+#define profile_hashptr(p)	((uint32_t)((uintptr_t)(p) >> 3) * 0x9e3779b1u)
+
+/* Reset the location table. */
+static void profile_locs_reset(ProfileLocs *pl)
+{
+  memset(pl, 0, sizeof(ProfileLocs));
+  pl->loc[0].key = (const void *)pl;  /* Never matches a real key. */
+  strcpy(pl->loc[0].name, "?");
+}
+
+/* Reset the aggregation tables. */
+static void profile_agg_reset(ProfileAgg *pa)
+{
+  memset(pa, 0, sizeof(ProfileAgg));
+  profile_locs_reset(&pa->locs);
+}
+
+/* Intern the location of a frame. No formatting unless it's a new one. */
+static uint32_t profile_loc(ProfileLocs *pl, lua_State *L, cTValue *frame,
+			    cTValue *nextframe)
+{
+  GCfunc *fn = frame_func(frame);
+  const void *key, *chunk = NULL;
+  BCLine line;
+  uint32_t i;
+  if (isluafunc(fn)) {
+    GCproto *pt = funcproto(fn);
+    key = (const void *)pt;
+    chunk = (const void *)proto_chunkname(pt);
+    line = lj_debug_frameline(L, fn, nextframe);
+    if (line < 0) line = pt->firstline;
+  } else if (isffunc(fn)) {
+    key = (const void *)(uintptr_t)fn->c.ffid;
+    line = -2;
+  } else {
+    key = (const void *)(uintptr_t)fn->c.f;
+    line = -3;
+  }
+  for (i = (profile_hashptr(key) ^ (uint32_t)line) & (LJ_PROFILE_NLOC-1); ;
+       i = (i+1) & (LJ_PROFILE_NLOC-1)) {
+    ProfileLoc *loc = &pl->loc[i];
+    if (loc->key == NULL) {
+      char *p = loc->name;
+      if (pl->nloc >= LJ_PROFILE_NLOC/4*3)
+	return 0;
+      pl->nloc++;
+      loc->key = key;
+      loc->chunk = chunk;
+      loc->line = line;
+      if (isluafunc(fn)) {
+	GCproto *pt = funcproto(fn);
+	lj_debug_shortname(p, proto_chunkname(pt), pt->firstline);
+	if (pt->firstline != ~(BCLine)0) {  /* Not a bytecode builtin. */
+	  p += strlen(p);
+	  *p++ = ':';
+	  p = lj_strfmt_wint(p, line);
+	  *p = '\0';
+	}
+	for (p = loc->name; *p; p++)
+	  if (*p == ';') *p = ',';  /* Reserved as frame separator. */
+      } else if (isffunc(fn)) {
+	memcpy(p, "[builtin#", 9);
+	p = lj_strfmt_wint(p+9, fn->c.ffid);
+	*p++ = ']';
+	*p = '\0';
+      } else {
+	*p++ = '@';
+	p = lj_strfmt_wptr(p, key);
+	*p = '\0';
+      }
+      return i;
+    }
+    if (loc->key == key && loc->line == line && loc->chunk == chunk)
+      return i;
+  }
+}
+
+/* Intern the locations of the current stack. Returns the depth. */
+static int profile_walk(ProfileLocs *pl, lua_State *L, uint16_t *loc)
+{
+  int depth, size;
+  cTValue *frame, *nextframe;
+  for (depth = 0; depth < LJ_PROFILE_MAXDEPTH; depth++) {
+    frame = lj_debug_frame(L, depth, &size);
+    if (!frame) break;
+    nextframe = size ? frame+size : NULL;
+    loc[depth] = (uint16_t)profile_loc(pl, L, frame, nextframe);
+  }
+  return depth;
+}
+
+/* Hash a stack. Never returns 0. */
+static uint32_t profile_hashstack(uint32_t h, const uint16_t *loc, int depth)
+{
+  int i;
+  for (i = 0; i < depth; i++)
+    h = (h ^ loc[i]) * 0x01000193u;  /* FNV-1a. */
+  return h ? h : 1;
+}
+
+/* Record samples for the current stack. Never calls back into Lua. */
+static void profile_record(ProfileAgg *pa, lua_State *L, int samples,
+			   int vmstate, int trace, int gcstate)
+{
+  uint16_t loc[LJ_PROFILE_MAXDEPTH];
+  int depth = profile_walk(&pa->locs, L, loc);
+  uint32_t h = profile_hashstack(((uint32_t)vmstate * 0x01000193u ^
+				  (uint32_t)trace) * 0x01000193u ^
+				 (uint32_t)(gcstate+1), loc, depth);
+  uint32_t i;
+  for (i = h & (LJ_PROFILE_NSTACK-1); ; i = (i+1) & (LJ_PROFILE_NSTACK-1)) {
+    ProfileStack *st = &pa->stack[i];
+    if (st->hash == 0) {
+      if (pa->nstack >= LJ_PROFILE_NSTACK/4*3) {
+	pa->lost += (MSize)samples;
+	return;
+      }
+      pa->nstack++;
+      st->hash = h;
+      st->trace = trace;
+      st->gcstate = (int16_t)gcstate;
+      st->vmstate = (uint8_t)vmstate;
+      st->depth = (uint8_t)depth;
+      memcpy(st->loc, loc, depth*sizeof(uint16_t));
+      st->count = (uint32_t)samples;
+      return;
+    }
+    if (st->hash == h && st->depth == depth && st->trace == trace &&
+	st->gcstate == gcstate && st->vmstate == (uint8_t)vmstate &&
+	memcmp(st->loc, loc, depth*sizeof(uint16_t)) == 0) {
+      st->count += (uint32_t)samples;
+      return;
+    }
+  }
+}
+
+/* -- Allocation sampling ------------------------------------------------ */
+
+/* Get the next sample interval. Exponentially distributed, so the sample
+** points form a Poisson process over the allocated bytes.
+*/
+static GCSize profile_allocnext(ProfileAlloc *pal)
+{
+  uint64_t x = pal->seed;
+  double u, d;
+  x ^= x >> 12; x ^= x << 25; x ^= x >> 27;  /* xorshift64*. */
+  pal->seed = x;
+  u = (double)((x * U64x(2545f491,4f6cdd1d)) >> 11) * (1.0/9007199254740992.0);
+  d = -log(1.0 - u) * (double)pal->rate;
+  if (d < 1.0) d = 1.0;
+  else if (d > (double)0x7fffffff) d = (double)0x7fffffff;
+  return (GCSize)d;
+}
+
+/* Add a sample to its site. Optionally track the object until it's old. */
+static void profile_allocsite(ProfileAlloc *pal, GCobj *o, int gct,
+			      int32_t trace, const uint16_t *loc, int depth,
+			      double bytes, double count)
+{
+  uint32_t h = profile_hashstack((uint32_t)gct * 0x01000193u ^
+				 (uint32_t)trace, loc, depth);
+  uint32_t i;
+  for (i = h & (LJ_PROFILE_NSITE-1); ; i = (i+1) & (LJ_PROFILE_NSITE-1)) {
+    ProfileSite *site = &pal->site[i];
+    if (site->hash == 0) {
+      if (pal->nsite >= LJ_PROFILE_NSITE/4*3) {
+	pal->lost += bytes;
+	return;
+      }
+      pal->nsite++;
+      site->hash = h;
+      site->trace = trace;
+      site->gct = (uint8_t)gct;
+      site->depth = (uint8_t)depth;
+      memcpy(site->loc, loc, depth*sizeof(uint16_t));
+      break;
+    }
+    if (site->hash == h && site->depth == depth && site->trace == trace &&
+	site->gct == (uint8_t)gct &&
+	memcmp(site->loc, loc, depth*sizeof(uint16_t)) == 0)
+      break;
+  }
+  pal->site[i].count += count;
+  pal->site[i].bytes += bytes;
+  if (o && pal->trackold) {  /* Evicts an older sample on collisions. */
+    ProfileTracked *t = &pal->tracked[profile_hashptr(o) & (LJ_PROFILE_NTRACK-1)];
+    t->o = o;
+    t->site = i;
+    t->bytes = bytes;
+  }
+}
+
+/* Add the pending sample. The object got its type in the meantime. */
+static void profile_allocresolve(ProfileAlloc *pal)
+{
+  GCobj *o = pal->pending;
+  pal->pending = NULL;
+  profile_allocsite(pal, o, o->gch.gct, pal->ptrace, pal->ploc, pal->pdepth,
+		    pal->pbytes, pal->pcount);
+}
+
+/* Take an allocation sample when the sample interval is used up. The new
+** GC object o has no type yet, or it's NULL for other memory. Called from
+** the allocator, so this must neither allocate nor throw.
+*/
+void lj_profile_allocsample(lua_State *L, GCobj *o, GCSize size)
+{
+  global_State *g = G(L);
+  ProfileState *ps = profile_state(g);
+  ProfileAlloc *pal = ps ? ps->alloc : NULL;
+  uint16_t loc[LJ_PROFILE_MAXDEPTH];
+  int depth = 0;
+  int32_t trace = 0;
+  double p;
+  if (!(pal && g->gc.allocsample)) {
+    g->gc.allocleft = ~(GCSize)0;  /* Off. Rearm only once in a while. */
+    return;
+  }
+  g->gc.allocleft = profile_allocnext(pal);
+  if (pal->pending)
+    profile_allocresolve(pal);
+  if (tvref(g->jit_base)) {  /* The frames are not in sync on trace. */
+    trace = g->vmstate > 0 ? g->vmstate : 0;
+  } else {
+    depth = profile_walk(&pal->locs, L, loc);
+  }
+  /* Scale by the sampling probability of this size to get estimates. */
+  p = 1.0 - exp(-(double)size / (double)pal->rate);
+  if (o) {
+    pal->pending = o;
+    pal->pbytes = (double)size / p;
+    pal->pcount = 1.0 / p;
+    pal->ptrace = trace;
+    pal->pdepth = (uint8_t)depth;
+    memcpy(pal->ploc, loc, depth*sizeof(uint16_t));
+  } else {
+    profile_allocsite(pal, NULL, LJ_PROFILE_ALLOCMEM, trace, loc, depth,
+		      (double)size / p, 1.0 / p);
+  }
+}
+
+/* A possibly sampled object is about to be freed. */
+void lj_profile_allocfree(global_State *g, GCobj *o)
+{
+  ProfileAlloc *pal = profile_state(g)->alloc;
+  ProfileTracked *t = &pal->tracked[profile_hashptr(o) & (LJ_PROFILE_NTRACK-1)];
+  if (o == pal->pending)
+    profile_allocresolve(pal);
+  if (t->o == o)
+    t->o = NULL;
+}
+
+/* A possibly sampled object turned G_OLD. */
+void lj_profile_allocold(global_State *g, GCobj *o)
+{
+  ProfileAlloc *pal = profile_state(g)->alloc;
+  ProfileTracked *t = &pal->tracked[profile_hashptr(o) & (LJ_PROFILE_NTRACK-1)];
+  if (o == pal->pending)
+    profile_allocresolve(pal);
+  if (t->o == o) {
+    pal->site[t->site].oldbytes += t->bytes;
+    t->o = NULL;
+  }
+}
+
 /* -- Profile callbacks --------------------------------------------------- */
 
 /* Callback from profile hook (HOOK_PROFILE already cleared). */
 void LJ_FASTCALL lj_profile_interpreter(lua_State *L)
 {
-  ProfileState *ps = &profile_state;
   global_State *g = G(L);
+  ProfileState *ps = profile_state(g);
   uint8_t mask;
   profile_lock(ps);
   mask = (g->hookmask & ~HOOK_PROFILE);
-  if (!(mask & HOOK_VMEVENT)) {
+  if (ps->native) {  /* No callback, so no need to block VM events. */
+    int samples = ps->samples, vmstate = ps->vmstate, trace = ps->trace;
+    int gcstate = ps->gcstate;
+    ps->samples = 0;
+    profile_unlock(ps);
+    profile_record(ps->agg, L, samples, vmstate, trace, gcstate);
+    profile_lock(ps);
+    mask |= (g->hookmask & HOOK_PROFILE);
+  } else if (!(mask & HOOK_VMEVENT)) {
     int samples = ps->samples;
     ps->samples = 0;
     g->hookmask = HOOK_VMEVENT;
@@ -145,6 +578,17 @@ void LJ_FASTCALL lj_profile_interpreter(lua_State *L)
   profile_unlock(ps);
 }
 
+/* Get the cycle and phase of a running GC. Racy, but only used for tagging. */
+static int profile_gcstate(global_State *g)
+{
+  GCStats *gs = &G2GG(g)->gcstats;
+  int cycle = gs->cycle, phase = gs->phase;
+  if (gs->depth && phase >= 0 && phase < GCPHASE__MAX &&
+      cycle >= 0 && cycle < GCCYCLE__MAX)
+    return cycle*GCPHASE__MAX + phase;
+  return -1;
+}
+
 /* Trigger profile hook. Asynchronous call from OS-specific profile timer. */
 static void profile_trigger(ProfileState *ps)
 {
@@ -159,6 +603,8 @@ static void profile_trigger(ProfileState *ps)
 		  st == ~LJ_VMST_INTERP ? 'I' :
 		  st == ~LJ_VMST_C ? 'C' :
 		  st == ~LJ_VMST_GC ? 'G' : 'J';
+    ps->trace = st >= 0 ? st : 0;
+    ps->gcstate = st == ~LJ_VMST_GC ? profile_gcstate(g) : -1;
     g->hookmask = (mask | HOOK_PROFILE);
     lj_dispatch_update(g);
   }
@@ -167,13 +613,77 @@ static void profile_trigger(ProfileState *ps)
 
 /* -- OS-specific profile timer handling ---------------------------------- */
 
-#if LJ_PROFILE_SIGPROF
+#if LJ_PROFILE_THREADTIMER
+
+/* The SIGPROF handler is shared by all timers. Protected by a spinlock. */
+static int profile_salock;
+static int profile_sacount;
+static struct sigaction profile_oldsa;
+
+/* SIGPROF handler. The timer passes its profiler state. */
+static void profile_signal(int sig, siginfo_t *si, void *ctx)
+{
+  UNUSED(sig); UNUSED(ctx);
+  if (si->si_code == SI_TIMER && si->si_value.sival_ptr)
+    profile_trigger((ProfileState *)si->si_value.sival_ptr);
+}
+
+/* Start profiling timer for the calling thread only. A CPU-time timer
+** counts the time the thread runs. A wall-time timer also fires while it
+** blocks, which interrupts system calls that are not restarted (EINTR).
+*/
+static void profile_timer_start(ProfileState *ps)
+{
+  int interval = ps->interval;
+  clockid_t clk = ps->clock == 'w' ? CLOCK_MONOTONIC : CLOCK_THREAD_CPUTIME_ID;
+  struct sigevent sev;
+  struct itimerspec tm;
+  while (__sync_lock_test_and_set(&profile_salock, 1)) ;
+  if (profile_sacount++ == 0) {
+    struct sigaction sa;
+    sa.sa_flags = SA_RESTART|SA_SIGINFO;
+    sa.sa_sigaction = profile_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGPROF, &sa, &profile_oldsa);
+  }
+  __sync_lock_release(&profile_salock);
+  memset(&sev, 0, sizeof(sev));
+  sev.sigev_notify = SIGEV_THREAD_ID;
+  sev.sigev_signo = SIGPROF;
+  sev.sigev_value.sival_ptr = ps;
+  sev.sigev_notify_thread_id = (pid_t)syscall(SYS_gettid);
+  ps->hastimer = (timer_create(clk, &sev, &ps->timer) == 0);
+  if (ps->hastimer) {
+    tm.it_value.tv_sec = tm.it_interval.tv_sec = interval / 1000;
+    tm.it_value.tv_nsec = tm.it_interval.tv_nsec = (interval % 1000) * 1000000;
+    timer_settime(ps->timer, 0, &tm, NULL);
+  }
+}
 
-/* SIGPROF handler. */
+/* Stop profiling timer. A deleted timer has no pending signals left. */
+static void profile_timer_stop(ProfileState *ps)
+{
+  if (ps->hastimer) {
+    timer_delete(ps->timer);
+    ps->hastimer = 0;
+  }
+  while (__sync_lock_test_and_set(&profile_salock, 1)) ;
+  if (--profile_sacount == 0)
+    sigaction(SIGPROF, &profile_oldsa, NULL);
+  __sync_lock_release(&profile_salock);
+}
+
+#elif LJ_PROFILE_SIGPROF
+
+/* Wall time uses the real-time timer and SIGALRM instead of SIGPROF. */
+#define profile_itimer(ps)	((ps)->clock == 'w' ? ITIMER_REAL : ITIMER_PROF)
+#define profile_itsig(ps)	((ps)->clock == 'w' ? SIGALRM : SIGPROF)
+
+/* SIGPROF or SIGALRM handler. */
 static void profile_signal(int sig)
 {
   UNUSED(sig);
-  profile_trigger(&profile_state);
+  profile_trigger(profile_sigstate);
 }
 
 /* Start profiling timer. */
@@ -184,11 +694,12 @@ static void profile_timer_start(ProfileState *ps)
   struct sigaction sa;
   tm.it_value.tv_sec = tm.it_interval.tv_sec = interval / 1000;
   tm.it_value.tv_usec = tm.it_interval.tv_usec = (interval % 1000) * 1000;
-  setitimer(ITIMER_PROF, &tm, NULL);
+  profile_sigstate = ps;
   sa.sa_flags = SA_RESTART;
   sa.sa_handler = profile_signal;
   sigemptyset(&sa.sa_mask);
-  sigaction(SIGPROF, &sa, &ps->oldsa);
+  sigaction(profile_itsig(ps), &sa, &ps->oldsa);
+  setitimer(profile_itimer(ps), &tm, NULL);
 }
 
 /* Stop profiling timer. */
@@ -197,18 +708,37 @@ static void profile_timer_stop(ProfileState *ps)
   struct itimerval tm;
   tm.it_value.tv_sec = tm.it_interval.tv_sec = 0;
   tm.it_value.tv_usec = tm.it_interval.tv_usec = 0;
-  setitimer(ITIMER_PROF, &tm, NULL);
-  sigaction(SIGPROF, &ps->oldsa, NULL);
+  setitimer(profile_itimer(ps), &tm, NULL);
+  sigaction(profile_itsig(ps), &ps->oldsa, NULL);
+  profile_sigstate = NULL;
 }
 
 #elif LJ_PROFILE_PTHREAD
 
-/* POSIX timer thread. */
+#if LJ_PROFILE_CPUCLOCK
+/* Get the CPU time of the profiled thread in ms. */
+static int64_t profile_cputime(ProfileState *ps)
+{
+  struct timespec ts;
+  if (clock_gettime(ps->cpuclock, &ts) != 0)
+    return 0;
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+#endif
+
+/* POSIX timer thread. For CPU time it polls the clock of the profiled
+** thread and triggers only after it ran for another interval.
+*/
 static void *profile_thread(ProfileState *ps)
 {
   int interval = ps->interval;
 #if !LJ_TARGET_PS3
   struct timespec ts;
+#endif
+#if LJ_PROFILE_CPUCLOCK
+  int64_t last = ps->clock == 'c' ? profile_cputime(ps) : 0;
+#endif
+#if !LJ_TARGET_PS3
   ts.tv_sec = interval / 1000;
   ts.tv_nsec = (interval % 1000) * 1000000;
 #endif
@@ -219,6 +749,13 @@ static void *profile_thread(ProfileState *ps)
     nanosleep(&ts, NULL);
 #endif
     if (ps->abort) break;
+#if LJ_PROFILE_CPUCLOCK
+    if (ps->clock == 'c') {
+      int64_t now = profile_cputime(ps);
+      if (now - last < interval) continue;
+      last = now;
+    }
+#endif
     profile_trigger(ps);
   }
   return NULL;
@@ -229,6 +766,13 @@ static void profile_timer_start(ProfileState *ps)
 {
   pthread_mutex_init(&ps->lock, 0);
   ps->abort = 0;
+#if LJ_PROFILE_CPUCLOCK
+  if (ps->clock == 'c' &&
+      pthread_getcpuclockid(pthread_self(), &ps->cpuclock) != 0)
+    ps->clock = 'w';  /* No CPU-time clock: fall back to wall time. */
+#else
+  ps->clock = 'w';
+#endif
   pthread_create(&ps->thread, NULL, (void *(*)(void *))profile_thread, ps);
 }
 
@@ -242,17 +786,40 @@ static void profile_timer_stop(ProfileState *ps)
 
 #elif LJ_PROFILE_WTHREAD
 
-/* Windows timer thread. */
+#if LJ_TARGET_WINDOWS
+/* Get the CPU time of the profiled thread in ms. Coarse (scheduler ticks). */
+static int64_t profile_cputime(ProfileState *ps)
+{
+  FILETIME ct, et, kt, ut;
+  if (!GetThreadTimes(ps->target, &ct, &et, &kt, &ut))
+    return 0;
+  return (int64_t)((((uint64_t)kt.dwHighDateTime << 32) + kt.dwLowDateTime +
+		    ((uint64_t)ut.dwHighDateTime << 32) + ut.dwLowDateTime) /
+		   10000);
+}
+#endif
+
+/* Windows timer thread. For CPU time it polls the times of the profiled
+** thread and triggers only after it ran for another interval.
+*/
 static DWORD WINAPI profile_thread(void *psx)
 {
   ProfileState *ps = (ProfileState *)psx;
   int interval = ps->interval;
 #if LJ_TARGET_WINDOWS
+  int64_t last = ps->clock == 'c' ? profile_cputime(ps) : 0;
   ps->wmm_tbp(interval);
 #endif
   while (1) {
     Sleep(interval);
     if (ps->abort) break;
+#if LJ_TARGET_WINDOWS
+    if (ps->clock == 'c') {
+      int64_t now = profile_cputime(ps);
+      if (now - last < interval) continue;
+      last = now;
+    }
+#endif
     profile_trigger(ps);
   }
 #if LJ_TARGET_WINDOWS
@@ -279,6 +846,16 @@ static void profile_timer_start(ProfileState *ps)
 #endif
   InitializeCriticalSection(&ps->lock);
   ps->abort = 0;
+#if LJ_TARGET_WINDOWS
+  ps->target = NULL;
+  if (ps->clock == 'c' &&
+      !DuplicateHandle(GetCurrentProcess(), GetCurrentThread(),
+		       GetCurrentProcess(), &ps->target,
+		       THREAD_QUERY_INFORMATION, FALSE, 0))
+    ps->clock = 'w';  /* No handle for the CPU time: fall back to wall time. */
+#else
+  ps->clock = 'w';
+#endif
   ps->thread = CreateThread(NULL, 0, profile_thread, ps, 0, NULL);
 }
 
@@ -288,6 +865,12 @@ static void profile_timer_stop(ProfileState *ps)
   ps->abort = 1;
   WaitForSingleObject(ps->thread, INFINITE);
   DeleteCriticalSection(&ps->lock);
+#if LJ_TARGET_WINDOWS
+  if (ps->target) {
+    CloseHandle(ps->target);
+    ps->target = NULL;
+  }
+#endif
 }
 
 #endif
@@ -298,8 +881,10 @@ static void profile_timer_stop(ProfileState *ps)
 LUA_API void luaJIT_profile_start(lua_State *L, const char *mode,
 				  luaJIT_profile_callback cb, void *data)
 {
-  ProfileState *ps = &profile_state;
+  ProfileState *ps = profile_getstate(L);
   int interval = LJ_PROFILE_INTERVAL_DEFAULT;
+  int clock = LJ_PROFILE_CLOCK_DEFAULT;
+  int native = (cb == NULL);
   while (*mode) {
     int m = *mode++;
     switch (m) {
@@ -309,6 +894,12 @@ LUA_API void luaJIT_profile_start(lua_State *L, const char *mode,
 	interval = interval * 10 + (*mode++ - '0');
       if (interval <= 0) interval = 1;
       break;
+    case 'a':
+      native = 1;
+      break;
+    case 'c': case 'w':
+      clock = m;
+      break;
 #if LJ_HASJIT
     case 'l': case 'f':
       L2J(L)->prof_mode = m;
@@ -319,25 +910,33 @@ LUA_API void luaJIT_profile_start(lua_State *L, const char *mode,
       break;
     }
   }
-  if (ps->g) {
+  if (ps->g)
     luaJIT_profile_stop(L);
-    if (ps->g) return;  /* Profiler in use by another VM. */
-  }
+#if LJ_PROFILE_SIGPROF && !LJ_PROFILE_THREADTIMER
+  if (profile_sigstate) return;  /* Profiler in use by another VM. */
+#endif
   ps->g = G(L);
   ps->interval = interval;
+  ps->clock = clock;
   ps->cb = cb;
   ps->data = data;
   ps->samples = 0;
-  lj_buf_init(L, &ps->sb);
+  ps->native = native;
+  if (native) {  /* Preallocate, so sampling never allocates. */
+    if (!ps->agg)
+      ps->agg = lj_mem_newt(L, sizeof(ProfileAgg), ProfileAgg);
+    profile_agg_reset(ps->agg);
+  }
+  setsbufL(&ps->sb, L);
   profile_timer_start(ps);
 }
 
 /* Stop profiling. */
 LUA_API void luaJIT_profile_stop(lua_State *L)
 {
-  ProfileState *ps = &profile_state;
-  global_State *g = ps->g;
-  if (G(L) == g) {  /* Only stop profiler if started by this VM. */
+  global_State *g = G(L);
+  ProfileState *ps = profile_state(g);
+  if (ps && ps->g) {
     profile_timer_stop(ps);
     g->hookmask &= ~HOOK_PROFILE;
     lj_dispatch_update(g);
@@ -356,7 +955,7 @@ LUA_API void luaJIT_profile_stop(lua_State *L)
 LUA_API const char *luaJIT_profile_dumpstack(lua_State *L, const char *fmt,
 					     int depth, size_t *len)
 {
-  ProfileState *ps = &profile_state;
+  ProfileState *ps = profile_getstate(L);
   SBuf *sb = &ps->sb;
   setsbufL(sb, L);
   lj_buf_reset(sb);
@@ -365,4 +964,155 @@ LUA_API const char *luaJIT_profile_dumpstack(lua_State *L, const char *fmt,
   return sbufB(sb);
 }
 
+/* Return the natively aggregated samples as folded stacks for flame graphs.
+** One line per stack, outermost frame first, then the VM state and count.
+*/
+LUA_API const char *luaJIT_profile_dumpfolded(lua_State *L, size_t *len)
+{
+  ProfileState *ps = profile_getstate(L);
+  ProfileAgg *pa = ps->agg;
+  SBuf *sb = &ps->sb;
+  setsbufL(sb, L);
+  lj_buf_reset(sb);
+  if (pa) {
+    MSize i;
+    for (i = 0; i < LJ_PROFILE_NSTACK; i++) {
+      ProfileStack *st = &pa->stack[i];
+      int d;
+      if (st->hash == 0) continue;
+      for (d = st->depth-1; d >= 0; d--) {
+	const char *name = pa->locs.loc[st->loc[d]].name;
+	lj_buf_putmem(sb, name, (MSize)strlen(name));
+	lj_buf_putb(sb, ';');
+      }
+      lj_buf_putb(sb, '[');
+      lj_buf_putb(sb, st->vmstate);
+      if (st->trace) {
+	lj_buf_putb(sb, '#');
+	lj_strfmt_putint(sb, st->trace);
+      } else if (st->gcstate >= 0) {  /* E.g. [G:young:sweepgen]. */
+	const char *cycle = profile_gccycle[st->gcstate / GCPHASE__MAX];
+	const char *phase = profile_gcphase[st->gcstate % GCPHASE__MAX];
+	lj_buf_putb(sb, ':');
+	lj_buf_putmem(sb, cycle, (MSize)strlen(cycle));
+	lj_buf_putb(sb, ':');
+	lj_buf_putmem(sb, phase, (MSize)strlen(phase));
+      }
+      lj_buf_putmem(sb, "] ", 2);
+      lj_strfmt_putint(sb, (int32_t)st->count);
+      lj_buf_putb(sb, '\n');
+    }
+    if (pa->lost) {
+      lj_buf_putmem(sb, "[lost] ", 7);
+      lj_strfmt_putint(sb, (int32_t)pa->lost);
+      lj_buf_putb(sb, '\n');
+    }
+  }
+  *len = (size_t)sbuflen(sb);
+  return sbufB(sb);
+}
+
+/* Start allocation sampling every rate bytes on average, or stop it if
+** rate is 0. Optionally track how much of the sampled memory gets old.
+** Samples of a previous run are kept until the next start.
+*/
+LUA_API void luaJIT_profile_alloc(lua_State *L, size_t rate, int trackold)
+{
+  global_State *g = G(L);
+  ProfileState *ps = profile_state(g);
+  ProfileAlloc *pal;
+  g->gc.allocsample = 0;
+  g->gc.allocleft = ~(GCSize)0;
+  if (rate == 0) {
+    if (ps && ps->alloc && ps->alloc->pending)
+      profile_allocresolve(ps->alloc);
+    return;
+  }
+  ps = profile_getstate(L);
+  if (!ps->alloc)  /* Preallocate, so sampling never allocates. */
+    ps->alloc = lj_mem_newt(L, sizeof(ProfileAlloc), ProfileAlloc);
+  pal = ps->alloc;
+  memset(pal, 0, sizeof(ProfileAlloc));
+  profile_locs_reset(&pal->locs);
+  pal->rate = rate > 0x7fffffff ? 0x7fffffff : (uint32_t)rate;
+  pal->trackold = trackold;
+  pal->seed = ((uint64_t)(uintptr_t)pal ^ U64x(9e3779b9,7f4a7c15)) | 1;
+  g->gc.allocleft = profile_allocnext(pal);
+  g->gc.allocsample = 1;
+}
+
+/* Return the allocation samples as folded stacks for flame graphs. The
+** weight is selected by what: 'b' estimated bytes, 'c' estimated number
+** of allocations, 'o' estimated bytes that survived to G_OLD.
+*/
+LUA_API const char *luaJIT_profile_dumpalloc(lua_State *L, int what,
+					     size_t *len)
+{
+  global_State *g = G(L);
+  ProfileState *ps = profile_getstate(L);
+  ProfileAlloc *pal = ps->alloc;
+  SBuf *sb = &ps->sb;
+  uint8_t running = g->gc.allocsample;
+  g->gc.allocsample = 0;  /* Don't sample the dump itself. */
+  setsbufL(sb, L);
+  lj_buf_reset(sb);
+  if (pal) {
+    MSize i;
+    if (pal->pending)
+      profile_allocresolve(pal);
+    for (i = 0; i < LJ_PROFILE_NSITE; i++) {
+      ProfileSite *site = &pal->site[i];
+      double v = what == 'c' ? site->count :
+		 what == 'o' ? site->oldbytes : site->bytes;
+      const char *name;
+      int d;
+      if (site->hash == 0 || v < 0.5) continue;
+      for (d = site->depth-1; d >= 0; d--) {
+	name = pal->locs.loc[site->loc[d]].name;
+	lj_buf_putmem(sb, name, (MSize)strlen(name));
+	lj_buf_putb(sb, ';');
+      }
+      if (site->trace) {
+	lj_buf_putmem(sb, "[trace#", 7);
+	lj_strfmt_putint(sb, site->trace);
+	lj_buf_putmem(sb, "];", 2);
+      }
+      name = site->gct == LJ_PROFILE_ALLOCMEM ? "mem" :
+	     lj_obj_itypename[site->gct];
+      lj_buf_putb(sb, '[');
+      lj_buf_putmem(sb, name, (MSize)strlen(name));
+      lj_buf_putmem(sb, "] ", 2);
+      lj_strfmt_putfxint(sb, STRFMT_UINT, (uint64_t)(v + 0.5));
+      lj_buf_putb(sb, '\n');
+    }
+    if (pal->lost >= 0.5 && what != 'c' && what != 'o') {
+      lj_buf_putmem(sb, "[lost] ", 7);
+      lj_strfmt_putfxint(sb, STRFMT_UINT, (uint64_t)(pal->lost + 0.5));
+      lj_buf_putb(sb, '\n');
+    }
+  }
+  if (running) {
+    g->gc.allocleft = profile_allocnext(pal);
+    g->gc.allocsample = 1;
+  }
+  *len = (size_t)sbuflen(sb);
+  return sbufB(sb);
+}
+
+/* Free the profiler state of a VM. */
+void lj_profile_freestate(global_State *g)
+{
+  ProfileState *ps = profile_state(g);
+  if (ps) {
+    lua_assert(ps->g == NULL);
+    lj_buf_free(g, &ps->sb);
+    if (ps->agg)
+      lj_mem_freet(g, ps->agg);
+    if (ps->alloc)
+      lj_mem_freet(g, ps->alloc);
+    lj_mem_freet(g, ps);
+    profile_state(g) = NULL;
+  }
+}
+
 #endif
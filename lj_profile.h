@@ -11,6 +11,10 @@
 #if LJ_HASPROFILE
 
 LJ_FUNC void LJ_FASTCALL lj_profile_interpreter(lua_State *L);
+LJ_FUNC void lj_profile_freestate(global_State *g);
+LJ_FUNC void lj_profile_allocsample(lua_State *L, GCobj *o, GCSize size);
+LJ_FUNC void lj_profile_allocfree(global_State *g, GCobj *o);
+LJ_FUNC void lj_profile_allocold(global_State *g, GCobj *o);
 #if !LJ_PROFILE_SIGPROF
 LJ_FUNC void LJ_FASTCALL lj_profile_hook_enter(global_State *g);
 LJ_FUNC void LJ_FASTCALL lj_profile_hook_leave(global_State *g);
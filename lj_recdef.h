@@ -95,6 +95,7 @@ static const uint16_t recff_idmap[] = {
 0x2800,
 0x2900,
 0,
+0,
 0x2a00,
 0x2b00,
 0,
@@ -164,6 +165,10 @@ static const uint16_t recff_idmap[] = {
 0,
 0,
 0,
+0,
+0,
+0,
+0,
 0x2f00+(0),
 0x2f00+(1),
 0x3000+(MM_eq),
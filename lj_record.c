@@ -1369,6 +1369,21 @@ static int nommstr(jit_State *J, TRef key)
   return 1;  /* CANNOT be a metamethod name. */
 }
 
+/* Guard against a store to a frozen table. */
+void lj_record_tabwrite(jit_State *J, TRef tab, GCtab *t)
+{
+  IRIns *ir = IR(tref_ref(tab));
+  if (!J->tabfrozen)
+    return;  /* No table frozen yet. lj_tab_freeze flushes all traces. */
+  if (ir->o == IR_TNEW || ir->o == IR_TDUP)
+    return;  /* Tables allocated on the trace are never frozen. */
+  if (tabisfrozen(t))  /* Let the interpreter throw. */
+    lj_trace_err(J, LJ_TRERR_GFAIL);
+  tab = emitir(IRT(IR_FLOAD, IRT_U8), tab, IRFL_TAB_MARKED);
+  tab = emitir(IRTI(IR_BAND), tab, lj_ir_kint(J, LJ_GC_FROZEN));
+  emitir(IRTGI(IR_EQ), tab, lj_ir_kint(J, 0));
+}
+
 /* Record indexed load/store. */
 TRef lj_record_idx(jit_State *J, RecordIndex *ix)
 {
@@ -1451,6 +1466,8 @@ TRef lj_record_idx(jit_State *J, RecordIndex *ix)
       lj_ir_rollback(J, rbref);  /* Rollback to eliminate hmask guard. */
       J->guardemit = rbguard;
     }
+    if (!tvisnil(oldv))  /* Checked before any __newindex lookup. */
+      lj_record_tabwrite(J, ix->tab, tabV(&ix->tabv));
     if (tvisnil(oldv)) {  /* Previous value was nil? */
       /* Need to duplicate the hasmm check for the early guards. */
       int hasmm = 0;
@@ -1468,6 +1485,7 @@ TRef lj_record_idx(jit_State *J, RecordIndex *ix)
 	goto handlemm;
       }
       lua_assert(!hasmm);
+      lj_record_tabwrite(J, ix->tab, tabV(&ix->tabv));
       if (oldv == niltvg(J2G(J))) {  /* Need to insert a new key. */
 	TRef key = ix->key;
 	if (tref_isinteger(key))  /* NEWREF needs a TValue as a key. */
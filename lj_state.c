@@ -27,6 +27,10 @@
 #include "lj_vm.h"
 #include "lj_lex.h"
 #include "lj_alloc.h"
+#include "lj_profile.h"
+#if LJ_HASGCTHREAD
+#include "lj_gcthread.h"
+#endif
 #include "luajit.h"
 
 /* -- Stack handling ------------------------------------------------------ */
@@ -162,16 +166,30 @@ static void close_state(lua_State *L)
   global_State *g = G(L);
   lj_func_closeuv(L, tvref(L->stack));
   lj_gc_freeall(g);
+  lj_gc_setmarkers(L, 0);
+  lj_gc_setnursery(L, 0);
+  lua_assert(mref(g->gc.nursery, GCNursery) == NULL);
   lua_assert(gcref(g->gc.root) == obj2gco(L));
   lua_assert(g->strnum == 0);
+#if LJ_HASPROFILE
+  lj_profile_freestate(g);
+#endif
   lj_trace_freestate(g);
 #if LJ_HASFFI
   lj_ctype_freestate(g);
 #endif
   lj_mem_freevec(g, g->strhash, g->strmask+1, GCRef);
+  lj_mem_freevec(g, mref(g->gc.youngstr, GCRef), g->gc.sizeyoungstr, GCRef);
+  lj_mem_freevec(g, mref(g->gc.remset, GCRef),
+		 mref(g->gc.remsetlim, GCRef) - mref(g->gc.remset, GCRef), GCRef);
+  lj_mem_freevec(g, mref(g->gc.old1, GCRef), g->gc.sizeold1, GCRef);
+  lj_mem_freevec(g, mref(g->gc.uvthreads, GCRef), g->gc.sizeuvthreads, GCRef);
   lj_buf_free(g, &g->tmpbuf);
   lj_mem_freevec(g, tvref(L->stack), L->stacksize, TValue);
   lua_assert(g->gc.total == sizeof(GG_State));
+#if LJ_HASGCTHREAD
+  lj_gcthread_stop(g);
+#endif
 #ifndef LUAJIT_USE_SYSMALLOC
   if (g->allocf == lj_alloc_f)
     lj_alloc_destroy(g->allocd);
@@ -219,6 +237,9 @@ LUA_API lua_State *lua_newstate(lua_Alloc f, void *ud)
   g->gc.stepmul = LUAI_GCMUL;
   g->gc.genminormul = LUAI_GENMINORMUL;
   setgcparam(g->gc.genmajormul, LUAI_GENMAJORMUL);
+  g->gc.genstepmul = LUAI_GENSTEPMUL;
+  g->gc.genbadmul = LUAI_GENBADMUL;
+  g->gc.genstablemul = LUAI_GENSTABLEMUL;
   lj_dispatch_init((GG_State *)L);
   L->status = LUA_ERRERR+1;  /* Avoid touching the stack upon memory error. */
   if (lj_vm_cpcall(L, NULL, NULL, cpluaopen) != 0) {
@@ -277,6 +298,7 @@ lua_State *lj_state_new(lua_State *L)
   L1->gct = ~LJ_TTHREAD;
   L1->dummy_ffid = FF_C;
   L1->status = LUA_OK;
+  L1->younguv = 0;
   L1->stacksize = 0;
   setmref(L1->stack, NULL);
   L1->cframe = NULL;
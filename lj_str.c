@@ -185,6 +185,8 @@ GCstr *lj_str_new(lua_State *L, const char *str, size_t lenx)
   s->nextgc = g->strhash[h];
   /* NOBARRIER: The string table is a GC root. */
   setgcref(g->strhash[h], obj2gco(s));
+  if (g->gc.kind == KGC_GEN)
+    lj_gc_addyoungstr(L, s);  /* Only young strings are swept by minor GCs. */
   if (g->strnum++ > g->strmask)  /* Allow a 100% load factor. */
     lj_str_resize(L, (g->strmask<<1)+1);  /* Grow string table. */
   return s;  /* Return newly interned string. */
@@ -13,6 +13,30 @@
 #include "lj_gc.h"
 #include "lj_err.h"
 #include "lj_tab.h"
+#include "lj_trace.h"
+
+/*
+** Colliding keys first look for a free node in the aligned group of
+** LJ_TAB_PROBE nodes around their main position, before taking one from
+** the top of the free list. This is not open addressing: it only changes
+** which free node a colliding key gets. Lookups still follow the chains,
+** and the node layout the VM and the JIT rely on is unchanged. Chains of
+** small tables thus tend to stay within the same pair of cache lines.
+** 0 disables it.
+*/
+#ifdef LUAJIT_TAB_PROBE
+#define LJ_TAB_PROBE	LUAJIT_TAB_PROBE
+#else
+#define LJ_TAB_PROBE	4
+#endif
+LJ_STATIC_ASSERT((LJ_TAB_PROBE & (LJ_TAB_PROBE-1)) == 0);
+
+/* Max. extra hash bits spent to avoid collisions in a frozen table. */
+#define LJ_TAB_FREEZEBITS	2
+
+/* Keys can't be added to or set through the C API of a frozen table. */
+#define tab_checkfrozen(L, t) \
+  { if (LJ_UNLIKELY(tabisfrozen(t))) lj_err_msg((L), LJ_ERR_TABRO); }
 
 /* -- Object hashing ------------------------------------------------------ */
 
@@ -47,7 +71,7 @@ static Node *hashkey(const GCtab *t, cTValue *key)
     return hashmask(t, boolV(key));
   else
     return hashgcref(t, key->gcr);
-  /* Only hash 32 bits of lightuserdata on a 64 bit CPU. Good enough? */
+  /* Without GC64 only 32 bits of lightuserdata are hashed on a 64 bit CPU. */
 }
 
 /* -- Table creation and destruction -------------------------------------- */
@@ -96,6 +120,22 @@ static LJ_AINLINE void clearapart(GCtab *t)
     setnilV(&array[i]);
 }
 
+/* Allocate a separate array part, with a clean card table if it's large. */
+static TValue *newarray(lua_State *L, uint32_t asize)
+{
+  MSize csz = sizetabcards(asize);
+  uint8_t *p = (uint8_t *)lj_mem_new(L, asize*sizeof(TValue) + csz);
+  memset(p, 0, csz);
+  return (TValue *)(p + csz);
+}
+
+/* Free a separate array part. */
+static void freearray(global_State *g, TValue *array, uint32_t asize)
+{
+  MSize csz = sizetabcards(asize);
+  lj_mem_free(g, (uint8_t *)array - csz, asize*sizeof(TValue) + csz);
+}
+
 /* Create a new table. Note: the slots are not initialized (yet). */
 static GCtab *newtab(lua_State *L, uint32_t asize, uint32_t hbits)
 {
@@ -135,7 +175,7 @@ static GCtab *newtab(lua_State *L, uint32_t asize, uint32_t hbits)
     if (asize > 0) {
       if (asize > LJ_MAX_ASIZE)
 	lj_err_msg(L, LJ_ERR_TABOV);
-      setmref(t->array, lj_mem_newvec(L, asize, TValue));
+      setmref(t->array, newarray(L, asize));
       t->asize = asize;
     }
   }
@@ -239,7 +279,7 @@ void LJ_FASTCALL lj_tab_free(global_State *g, GCtab *t)
   if (t->hmask > 0)
     lj_mem_freevec(g, noderef(t->node), t->hmask+1, Node);
   if (t->asize > 0 && LJ_MAX_COLOSIZE != 0 && t->colo <= 0)
-    lj_mem_freevec(g, tvref(t->array), t->asize, TValue);
+    freearray(g, tvref(t->array), t->asize);
   if (LJ_MAX_COLOSIZE != 0 && t->colo)
     lj_mem_free(g, t, sizetabcolo((uint32_t)t->colo & 0x7f));
   else
@@ -248,7 +288,29 @@ void LJ_FASTCALL lj_tab_free(global_State *g, GCtab *t)
 
 /* -- Table resizing ------------------------------------------------------ */
 
-/* Resize a table to fit the new array/hash part sizes. */
+/* Reinsert a key from the old hash part after a resize.
+** Keys are unique and the new parts are sized to fit, so the chain lookup
+** of lj_tab_set() is redundant. Only keys that moved to the array part
+** need special treatment.
+*/
+static TValue *tab_reinsert(lua_State *L, GCtab *t, cTValue *key)
+{
+  lua_assert(!tvisint(key) && !tvisnil(key));
+  if (tvisnum(key)) {
+    lua_Number nk = numV(key);
+    int32_t k = lj_num2int(nk);
+    if ((uint32_t)k < t->asize && nk == (lua_Number)k)
+      return arrayslot(t, k);
+  }
+  return lj_tab_newkey(L, t, key);
+}
+
+/*
+** Resize a table to fit the new array/hash part sizes.
+** All pairs are moved in one go, so the pause still grows with the size
+** of the table. There is no incremental rehash: the VM and the JIT read
+** t->node and t->hmask directly and know only one node array.
+*/
 void lj_tab_resize(lua_State *L, GCtab *t, uint32_t asize, uint32_t hbits)
 {
   Node *oldnode = noderef(t->node);
@@ -262,10 +324,18 @@ void lj_tab_resize(lua_State *L, GCtab *t, uint32_t asize, uint32_t hbits)
     if (LJ_MAX_COLOSIZE != 0 && t->colo > 0) {
       /* A colocated array must be separated and copied. */
       TValue *oarray = tvref(t->array);
-      array = lj_mem_newvec(L, asize, TValue);
+      array = newarray(L, asize);
       t->colo = (int8_t)(t->colo | 0x80);  /* Mark as separated (colo < 0). */
       for (i = 0; i < oldasize; i++)
 	copyTV(L, &array[i], &oarray[i]);
+    } else if (sizetabcards(asize)) {
+      /* Arrays with a card table are never reallocated in place. */
+      TValue *oarray = tvref(t->array);
+      array = newarray(L, asize);
+      for (i = 0; i < oldasize; i++)
+	copyTV(L, &array[i], &oarray[i]);
+      if (oldasize)
+	freearray(G(L), oarray, oldasize);
     } else {
       array = (TValue *)lj_mem_realloc(L, tvref(t->array),
 			  oldasize*sizeof(TValue), asize*sizeof(TValue));
@@ -292,12 +362,27 @@ void lj_tab_resize(lua_State *L, GCtab *t, uint32_t asize, uint32_t hbits)
     uint32_t i;
     t->asize = asize;  /* Note: This 'shrinks' even colocated arrays. */
     for (i = asize; i < oldasize; i++)  /* Reinsert old array values. */
-      if (!tvisnil(&array[i]))
-	copyTV(L, lj_tab_setinth(L, t, (int32_t)i), &array[i]);
+      if (!tvisnil(&array[i])) {
+	TValue k;
+	setnumV(&k, (lua_Number)i);
+	copyTV(L, lj_tab_newkey(L, t, &k), &array[i]);
+      }
     /* Physically shrink only separated arrays. */
-    if (LJ_MAX_COLOSIZE != 0 && t->colo <= 0)
-      setmref(t->array, lj_mem_realloc(L, array,
-	      oldasize*sizeof(TValue), asize*sizeof(TValue)));
+    if (LJ_MAX_COLOSIZE != 0 && t->colo <= 0) {
+      if (sizetabcards(oldasize)) {
+	TValue *narray = NULL;
+	if (asize) {
+	  narray = newarray(L, asize);
+	  for (i = 0; i < asize; i++)
+	    copyTV(L, &narray[i], &array[i]);
+	}
+	freearray(G(L), array, oldasize);
+	setmref(t->array, narray);
+      } else {
+	setmref(t->array, lj_mem_realloc(L, array,
+		oldasize*sizeof(TValue), asize*sizeof(TValue)));
+      }
+    }
   }
   if (oldhmask > 0) {  /* Reinsert pairs from old hash part. */
     global_State *g;
@@ -305,11 +390,14 @@ void lj_tab_resize(lua_State *L, GCtab *t, uint32_t asize, uint32_t hbits)
     for (i = 0; i <= oldhmask; i++) {
       Node *n = &oldnode[i];
       if (!tvisnil(&n->val))
-	copyTV(L, lj_tab_set(L, t, &n->key), &n->val);
+	copyTV(L, tab_reinsert(L, t, &n->key), &n->val);
     }
     g = G(L);
     lj_mem_freevec(g, oldnode, oldhmask+1, Node);
   }
+  /* Values have moved between cards, so let the GC rescan the whole table. */
+  if (sizetabcards(t->asize))
+    lj_gc_anybarriert(L, t);
 }
 
 static uint32_t countint(cTValue *key, uint32_t *bins)
@@ -461,20 +549,47 @@ cTValue *lj_tab_get(lua_State *L, GCtab *t, cTValue *key)
 /* -- Table setters ------------------------------------------------------- */
 
 /* Insert new key. Use Brent's variation to optimize the chain length. */
+#if LJ_TAB_PROBE
+/* Find a free node in the group of the main position or return NULL. */
+static Node *tab_groupfree(GCtab *t, Node *n)
+{
+  Node *node = noderef(t->node);
+  Node *g;
+  MSize i;
+  if (t->hmask < LJ_TAB_PROBE)
+    return NULL;
+  g = &node[(MSize)(n - node) & ~(MSize)(LJ_TAB_PROBE-1)];
+  for (i = 0; i < LJ_TAB_PROBE; i++)
+    if (tvisnil(&g[i].key))
+      return &g[i];
+  return NULL;
+}
+#endif
+
 TValue *lj_tab_newkey(lua_State *L, GCtab *t, cTValue *key)
 {
-  Node *n = hashkey(t, key);
+  Node *n;
+  tab_checkfrozen(L, t);
+  n = hashkey(t, key);
   if (!tvisnil(&n->val) || t->hmask == 0) {
     Node *nodebase = noderef(t->node);
-    Node *collide, *freenode = getfreetop(t, nodebase);
-    lua_assert(freenode >= nodebase && freenode <= nodebase+t->hmask+1);
-    do {
-      if (freenode == nodebase) {  /* No free node found? */
-	rehashtab(L, t, key);  /* Rehash table. */
-	return lj_tab_set(L, t, key);  /* Retry key insertion. */
-      }
-    } while (!tvisnil(&(--freenode)->key));
-    setfreetop(t, nodebase, freenode);
+    Node *collide, *freenode;
+#if LJ_TAB_PROBE
+    /* Nodes above the free top always have keys, so it stays valid. */
+    freenode = tab_groupfree(t, n);
+    if (!freenode)
+#endif
+    {
+      freenode = getfreetop(t, nodebase);
+      lua_assert(freenode >= nodebase && freenode <= nodebase+t->hmask+1);
+      do {
+	if (freenode == nodebase) {  /* No free node found? */
+	  rehashtab(L, t, key);  /* Rehash table. */
+	  return lj_tab_set(L, t, key);  /* Retry key insertion. */
+	}
+      } while (!tvisnil(&(--freenode)->key));
+      setfreetop(t, nodebase, freenode);
+    }
     lua_assert(freenode != &G(L)->nilnode);
     collide = hashkey(t, &n->key);
     if (collide != n) {  /* Colliding node not the main node? */
@@ -517,6 +632,7 @@ TValue *lj_tab_setinth(lua_State *L, GCtab *t, int32_t key)
 {
   TValue k;
   Node *n;
+  tab_checkfrozen(L, t);
   k.n = (lua_Number)key;
   n = hashnum(t, &k);
   do {
@@ -529,7 +645,9 @@ TValue *lj_tab_setinth(lua_State *L, GCtab *t, int32_t key)
 TValue *lj_tab_setstr(lua_State *L, GCtab *t, GCstr *key)
 {
   TValue k;
-  Node *n = hashstr(t, key);
+  Node *n;
+  tab_checkfrozen(L, t);
+  n = hashstr(t, key);
   do {
     if (tvisstr(&n->key) && strV(&n->key) == key)
       return &n->val;
@@ -541,6 +659,7 @@ TValue *lj_tab_setstr(lua_State *L, GCtab *t, GCstr *key)
 TValue *lj_tab_set(lua_State *L, GCtab *t, cTValue *key)
 {
   Node *n;
+  tab_checkfrozen(L, t);
   t->nomm = 0;  /* Invalidate negative metamethod cache. */
   if (tvisstr(key)) {
     return lj_tab_setstr(L, t, strV(key));
@@ -667,3 +786,98 @@ MSize LJ_FASTCALL lj_tab_len(GCtab *t)
   return unbound_search(t, j);
 }
 
+
+/* -- Table freezing ------------------------------------------------------ */
+
+/* Count the keys in the hash part that are not at their main position. */
+static uint32_t tab_displaced(const GCtab *t)
+{
+  Node *node = noderef(t->node);
+  uint32_t i, nd = 0;
+  for (i = 0; i <= t->hmask; i++) {
+    Node *n = &node[i];
+    if (!tvisnil(&n->val) && hashkey(t, &n->key) != n)
+      nd++;
+  }
+  return nd;
+}
+
+/*
+** Freeze a table. It's repacked first: the array part is sized to fit and
+** the hash part may grow by up to LJ_TAB_FREEZEBITS extra bits, until no
+** key has to be chained away from its main position. A lookup then only
+** touches a single node. The node layout itself is unchanged, since the VM
+** and the JIT read it directly.
+**
+** Freezing is a write protection flag. It does not switch the table to a
+** read-optimised representation. Compiled code only checks the flag once
+** some table has been frozen, so the first freeze flushes all traces.
+*/
+void lj_tab_freeze(lua_State *L, GCtab *t)
+{
+  uint32_t bins[LJ_MAX_ABITS];
+  uint32_t total, asize, na, i, hbits, maxbits, best, bestnd = ~0u;
+  if (tabisfrozen(t))
+    return;
+#if LJ_HASJIT
+  if (!L2J(L)->tabfrozen) {
+    /* Traces recorded so far have no frozen guards. But not during __gc. */
+    if (lj_trace_flushall(L))
+      lj_err_caller(L, LJ_ERR_NOGCMM);
+    L2J(L)->tabfrozen = 1;
+  }
+#endif
+  for (i = 0; i < LJ_MAX_ABITS; i++) bins[i] = 0;
+  asize = countarray(t, bins);
+  total = asize;
+  total += counthash(t, bins, &asize);
+  na = bestasize(bins, &asize);
+  total -= na;
+  best = hbits = hsize2hbits(total);
+  maxbits = hbits ? hbits + LJ_TAB_FREEZEBITS : 0;
+  if (maxbits > LJ_MAX_HBITS) maxbits = LJ_MAX_HBITS;
+  for (;;) {
+    uint32_t nd;
+    lj_tab_resize(L, t, asize, hbits);
+    nd = tab_displaced(t);
+    if (nd < bestnd) {
+      bestnd = nd;
+      best = hbits;
+    }
+    if (nd == 0 || hbits >= maxbits) break;
+    hbits++;
+  }
+  if (best != hbits)
+    lj_tab_resize(L, t, asize, best);
+  t->marked |= LJ_GC_FROZEN;
+}
+
+/* -- Table statistics ---------------------------------------------------- */
+
+#if LJ_HASJIT
+/* Count the keys in the hash part and the nodes visited to look them up. */
+uint32_t lj_tab_chainstats(const GCtab *t, uint32_t *maxlen, uint64_t *sumlen)
+{
+  Node *node = noderef(t->node);
+  uint32_t i, nkeys = 0, mlen = 0;
+  uint64_t slen = 0;
+  for (i = 0; i <= t->hmask; i++) {
+    Node *n = &node[i];
+    if (!tvisnil(&n->val)) {
+      Node *p = hashkey(t, &n->key);
+      uint32_t len = 1;
+      while (p && p != n) {
+	p = nextnode(p);
+	len++;
+      }
+      lua_assert(p == n);
+      if (len > mlen) mlen = len;
+      slen += len;
+      nkeys++;
+    }
+  }
+  *maxlen = mlen;
+  *sumlen = slen;
+  return nkeys;
+}
+#endif
@@ -13,6 +13,7 @@
 #define HASH_ROT1	14
 #define HASH_ROT2	5
 #define HASH_ROT3	13
+#define HASH_FOLD	16
 
 /* Scramble the bits of numbers and pointers. */
 static LJ_AINLINE uint32_t hashrot(uint32_t lo, uint32_t hi)
@@ -28,6 +29,8 @@ static LJ_AINLINE uint32_t hashrot(uint32_t lo, uint32_t hi)
   hi = lo ^ lj_rol(hi, HASH_ROT1 + HASH_ROT2);
   hi = hi - lj_rol(lo, HASH_ROT3);
 #endif
+  /* Fold the upper half down. Only the low bits survive the hash mask. */
+  hi ^= hi >> HASH_FOLD;
   return hi;
 }
 
@@ -69,5 +72,10 @@ LJ_FUNC TValue *lj_tab_set(lua_State *L, GCtab *t, cTValue *key);
 
 LJ_FUNCA int lj_tab_next(lua_State *L, GCtab *t, TValue *key);
 LJ_FUNCA MSize LJ_FASTCALL lj_tab_len(GCtab *t);
+LJ_FUNC void lj_tab_freeze(lua_State *L, GCtab *t);
+#if LJ_HASJIT
+LJ_FUNC uint32_t lj_tab_chainstats(const GCtab *t, uint32_t *maxlen,
+				   uint64_t *sumlen);
+#endif
 
 #endif
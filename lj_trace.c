@@ -875,7 +875,8 @@ int LJ_FASTCALL lj_trace_exit(jit_State *J, void *exptr)
   setcframe_pc(cf, pc);
   if (LJ_HASPROFILE && (G(L)->hookmask & HOOK_PROFILE)) {
     /* Just exit to interpreter. */
-  } else if (G(L)->gc.state == GCSatomic || G(L)->gc.state == GCSfinalize) {
+  } else if (G(L)->gc.state == GCSatomic || G(L)->gc.state == GCSfinalize ||
+	     (G(L)->gc.kind == KGC_GEN && G(L)->gc.total >= G(L)->gc.threshold)) {
     if (!(G(L)->hookmask & HOOK_GC))
       lj_gc_step(L);  /* Exited because of GC: drive GC forward. */
   } else {
@@ -49,6 +49,7 @@
 #include "lj_strfmt_num.c"
 #include "lj_api.c"
 #include "lj_profile.c"
+#include "lj_gcthread.c"
 #include "lj_lex.c"
 #include "lj_parse.c"
 #include "lj_bcread.c"
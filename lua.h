@@ -230,6 +230,14 @@ LUA_API int  (lua_status) (lua_State *L);
 #define LUA_GCISRUNNING		9
 #define LUA_GCGEN 10
 #define LUA_GCINC 11
+#define LUA_GCSETGENSTEPMUL	12
+#define LUA_GCSETGENBADMUL	13
+#define LUA_GCSETGENSTABLEMUL	14
+#define LUA_GCSETBGFREE		15
+#define LUA_GCSETMARKERS	16
+#define LUA_GCSETNURSERY	18
+#define LUA_GCTRIM		20
+#define LUA_GCSETAUTOTRIM	21
 
 LUA_API int (lua_gc) (lua_State *L, int what, ...);
 
@@ -59,11 +59,24 @@ enum {
 #define LUAJIT_MODE_ON		0x0100	/* Turn feature on. */
 #define LUAJIT_MODE_FLUSH	0x0200	/* Flush JIT-compiled code. */
 
+/* Allocator modes for luaJIT_newstate. */
+#define LUAJIT_ALLOC_HUGEPAGE	0x0001	/* Transparent 2MB huge pages. */
+#define LUAJIT_ALLOC_HUGETLB	0x0002	/* Explicit huge pages, if reserved. */
+
 /* LuaJIT public C API. */
 
 /* Control the JIT engine. */
 LUA_API int luaJIT_setmode(lua_State *L, int idx, int mode);
 
+/* Create a state with a tuned bundled allocator. node = -1: any NUMA node. */
+LUA_API lua_State *luaJIT_newstate(size_t segsize, int mode, int node);
+
+/* Push a table with GC pause and phase telemetry. reset != 0: clear it. */
+LUA_API void luaJIT_gcstats(lua_State *L, int reset);
+
+/* Push a table with allocator and per-type heap statistics. */
+LUA_API void luaJIT_allocstats(lua_State *L);
+
 /* Low-overhead profiling API. */
 typedef void (*luaJIT_profile_callback)(void *data, lua_State *L,
 					int samples, int vmstate);
@@ -72,6 +85,10 @@ LUA_API void luaJIT_profile_start(lua_State *L, const char *mode,
 LUA_API void luaJIT_profile_stop(lua_State *L);
 LUA_API const char *luaJIT_profile_dumpstack(lua_State *L, const char *fmt,
 					     int depth, size_t *len);
+LUA_API const char *luaJIT_profile_dumpfolded(lua_State *L, size_t *len);
+LUA_API void luaJIT_profile_alloc(lua_State *L, size_t rate, int trackold);
+LUA_API const char *luaJIT_profile_dumpalloc(lua_State *L, int what,
+					     size_t *len);
 
 /* Enforce (dynamic) linker error for version mismatches. Call from main. */
 LUA_API void LUAJIT_VERSION_SYM(void);